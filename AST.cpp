@@ -17,10 +17,32 @@ llvm::Value *CallExprAST::accept(NodeVisitor *visitor) const {
   return visitor->visit(this);
 }
 
+llvm::Value *IfExprAST::accept(NodeVisitor *visitor) const {
+  return visitor->visit(this);
+}
+
+llvm::Value *ForExprAST::accept(NodeVisitor *visitor) const {
+  return visitor->visit(this);
+}
+
+llvm::Value *VarExprAST::accept(NodeVisitor *visitor) const {
+  return visitor->visit(this);
+}
+
+llvm::Value *AssignExprAST::accept(NodeVisitor *visitor) const {
+  return visitor->visit(this);
+}
+
 llvm::Function *PrototypeAST::accept(NodeVisitor *visitor) const {
   return visitor->visit(this);
 }
 
+PrototypeAST *PrototypeAST::clone(Arena &arena) const {
+  auto copy = arena.make<PrototypeAST>(name, arena.copy(args));
+  copy->set_id(id);
+  return copy;
+}
+
 llvm::Function *FunctionAST::accept(NodeVisitor *visitor) const {
   return visitor->visit(this);
 }
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
@@ -19,17 +20,41 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 
+#include "Arena.hpp"
+#include "Symbol.hpp"
 #include "Visitor.hpp"
 // #include "Codegen.hpp"
 
 class NodeVisitor; // forward reference
 
+// All nodes are allocated in an ast::Arena and hold plain pointers to their
+// children. Nodes are never destroyed individually, which is why none of them
+// has a destructor.
 namespace ast {
 // Base node of the AST
 class ExprAST {
 public:
-  virtual ~ExprAST() {}
+  // discriminator for llvm::isa<>/llvm::dyn_cast<>, the tree is built with
+  // -fno-rtti
+  enum Kind {
+    expr_number,
+    expr_variable,
+    expr_binary,
+    expr_call,
+    expr_if,
+    expr_for,
+    expr_var,
+    expr_assign
+  };
+
+  explicit ExprAST(Kind kind) : kind(kind) {}
+
+  Kind get_kind() const { return kind; }
+
   virtual llvm::Value *accept(NodeVisitor *visitor) const = 0;
+
+private:
+  const Kind kind;
 };
 
 // NumberExprAST - Expression class for numeric literals like "1.0".
@@ -37,94 +62,259 @@ class NumberExprAST : public ExprAST {
   double val;
 
 public:
-  explicit NumberExprAST(double val) : val(val) {}
+  explicit NumberExprAST(double val) : ExprAST(expr_number), val(val) {}
 
   double get_val() const { return val; }
 
   llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_number; }
 };
 
 // Expression class for variables
 class VariableExprAST : public ExprAST {
-  std::string name;
+  Symbol name;
+  unsigned slot; // bound by the Resolver
 
 public:
-  explicit VariableExprAST(const std::string &name) : name(name) {}
+  explicit VariableExprAST(Symbol name)
+      : ExprAST(expr_variable), name(name), slot(~0u) {}
+
+  Symbol get_name() const { return name; }
 
-  const std::string &get_name() const { return name; }
+  // index of the argument, loop or var variable this variable refers to
+  unsigned get_slot() const { return slot; }
+  void set_slot(unsigned s) { slot = s; }
 
   llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  static bool classof(const ExprAST *e) {
+    return e->get_kind() == expr_variable;
+  }
 };
 
 // Expression class for binary operations
 class BinaryExprAST : public ExprAST {
   char op;
-  std::unique_ptr<ExprAST> lhs, rhs;
+  ExprAST *lhs, *rhs;
 
 public:
-  BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs,
-                std::unique_ptr<ExprAST> rhs)
-      : lhs(std::move(lhs)), rhs(std::move(rhs)), op(op) {}
+  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
+      : ExprAST(expr_binary), op(op), lhs(lhs), rhs(rhs) {}
 
   char get_op() const { return op; }
 
-  const ExprAST *get_lhs() const { return lhs.get(); }
+  const ExprAST *get_lhs() const { return lhs; }
+  ExprAST *get_lhs() { return lhs; }
+
+  const ExprAST *get_rhs() const { return rhs; }
+  ExprAST *get_rhs() { return rhs; }
 
-  const ExprAST *get_rhs() const { return rhs.get(); }
+  void set_lhs(ExprAST *e) { lhs = e; }
+  void set_rhs(ExprAST *e) { rhs = e; }
 
   llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_binary; }
 };
 
 // Expression class for calls
 class CallExprAST : public ExprAST {
-  std::string callee;
-  std::vector<std::unique_ptr<ExprAST>> args;
+  Symbol callee;
+  unsigned callee_id; // bound by the Resolver
+  llvm::ArrayRef<ExprAST *> args;
+
+public:
+  CallExprAST(Symbol callee, llvm::ArrayRef<ExprAST *> args)
+      : ExprAST(expr_call), callee(callee), callee_id(~0u), args(args) {}
+
+  llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  Symbol get_callee() const { return callee; }
+
+  // function id of the callee
+  unsigned get_callee_id() const { return callee_id; }
+  void set_callee_id(unsigned id) { callee_id = id; }
+
+  llvm::ArrayRef<ExprAST *> get_args() const { return args; }
+  void set_args(llvm::ArrayRef<ExprAST *> a) { args = a; }
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_call; }
+};
+
+// the truth of an if or loop condition, like the FCmpONE Codegen emits
+inline bool is_true(double value) { return value < 0 || value > 0; }
+
+// IfExprAST - if cond then a else b; its value is that of the branch taken.
+// A condition is true if it is neither 0.0 nor NaN.
+class IfExprAST : public ExprAST {
+  ExprAST *cond, *then, *els;
+
+public:
+  IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *els)
+      : ExprAST(expr_if), cond(cond), then(then), els(els) {}
+
+  llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  const ExprAST *get_cond() const { return cond; }
+  ExprAST *get_cond() { return cond; }
+  const ExprAST *get_then() const { return then; }
+  ExprAST *get_then() { return then; }
+  const ExprAST *get_else() const { return els; }
+  ExprAST *get_else() { return els; }
+
+  void set_cond(ExprAST *e) { cond = e; }
+  void set_then(ExprAST *e) { then = e; }
+  void set_else(ExprAST *e) { els = e; }
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_if; }
+};
+
+// ForExprAST - for var = start, end, step in body: var starts out as start,
+// and for as long as end is true before an iteration the body runs and step
+// (1.0 if left out) is added to var. var is only visible in end, step and
+// body. Its value is always 0.0.
+class ForExprAST : public ExprAST {
+  Symbol var;
+  unsigned slot; // of var, assigned by the Resolver
+  bool assigned;  // whether the loop assigns var, set by the Resolver
+  ExprAST *start, *end, *step, *body; // step may be null
 
 public:
-  CallExprAST(const std::string &callee,
-              std::vector<std::unique_ptr<ExprAST>> args)
-      : callee(callee), args(std::move(args)) {}
+  ForExprAST(Symbol var, ExprAST *start, ExprAST *end, ExprAST *step,
+             ExprAST *body)
+      : ExprAST(expr_for), var(var), slot(~0u), assigned(false),
+        start(start), end(end), step(step), body(body) {}
 
   llvm::Value *accept(NodeVisitor *visitor) const override;
 
-  const std::string &get_callee() const { return callee; }
+  Symbol get_var() const { return var; }
 
-  const std::vector<std::unique_ptr<ExprAST>> &get_args() const { return args; }
+  unsigned get_slot() const { return slot; }
+  void set_slot(unsigned s) { slot = s; }
+
+  bool is_assigned() const { return assigned; }
+  void set_assigned() { assigned = true; }
+
+  const ExprAST *get_start() const { return start; }
+  ExprAST *get_start() { return start; }
+  const ExprAST *get_end() const { return end; }
+  ExprAST *get_end() { return end; }
+  const ExprAST *get_step() const { return step; }
+  ExprAST *get_step() { return step; }
+  const ExprAST *get_body() const { return body; }
+  ExprAST *get_body() { return body; }
+
+  void set_start(ExprAST *e) { start = e; }
+  void set_end(ExprAST *e) { end = e; }
+  void set_step(ExprAST *e) { step = e; }
+  void set_body(ExprAST *e) { body = e; }
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_for; }
+};
+
+// VarExprAST - var a = x, b in body: binds each name to its initial value
+// (0.0 if left out) and evaluates to body. An initial value sees the names
+// bound before it, the body sees them all.
+class VarExprAST : public ExprAST {
+  llvm::ArrayRef<Symbol> names;
+  llvm::ArrayRef<ExprAST *> inits; // one per name, null if left out
+  unsigned slot; // of the first name, the others follow; set by the Resolver
+  ExprAST *body;
+
+public:
+  VarExprAST(llvm::ArrayRef<Symbol> names, llvm::ArrayRef<ExprAST *> inits,
+             ExprAST *body)
+      : ExprAST(expr_var), names(names), inits(inits), slot(~0u), body(body) {}
+
+  llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  llvm::ArrayRef<Symbol> get_names() const { return names; }
+
+  llvm::ArrayRef<ExprAST *> get_inits() const { return inits; }
+  void set_inits(llvm::ArrayRef<ExprAST *> e) { inits = e; }
+
+  unsigned get_slot() const { return slot; }
+  void set_slot(unsigned s) { slot = s; }
+
+  const ExprAST *get_body() const { return body; }
+  ExprAST *get_body() { return body; }
+  void set_body(ExprAST *e) { body = e; }
+
+  static bool classof(const ExprAST *e) { return e->get_kind() == expr_var; }
+};
+
+// AssignExprAST - var = value, which also evaluates to value
+class AssignExprAST : public ExprAST {
+  VariableExprAST *var;
+  ExprAST *value;
+
+public:
+  AssignExprAST(VariableExprAST *var, ExprAST *value)
+      : ExprAST(expr_assign), var(var), value(value) {}
+
+  llvm::Value *accept(NodeVisitor *visitor) const override;
+
+  const VariableExprAST *get_var() const { return var; }
+  VariableExprAST *get_var() { return var; }
+
+  const ExprAST *get_value() const { return value; }
+  ExprAST *get_value() { return value; }
+  void set_value(ExprAST *e) { value = e; }
+
+  static bool classof(const ExprAST *e) {
+    return e->get_kind() == expr_assign;
+  }
 };
 
 // PrototypeAST - This class represents the "prototype" for a function,
 // which captures its name, and its argument names (thus implicitly the number
 // of arguments the function takes).
 class PrototypeAST {
-  std::string name;
-  std::vector<std::string> args;
+  Symbol name;
+  llvm::ArrayRef<Symbol> args;
+  unsigned id; // function id, assigned by the FunctionTable
 
 public:
-  PrototypeAST(const std::string &name, std::vector<std::string> args)
-      : name(name), args(std::move(args)) {}
+  PrototypeAST(Symbol name, llvm::ArrayRef<Symbol> args)
+      : name(name), args(args), id(~0u) {}
 
-  const std::string &get_name() const { return name; }
+  Symbol get_name() const { return name; }
+
+  unsigned get_id() const { return id; }
+  void set_id(unsigned i) { id = i; }
 
   llvm::Function *accept(NodeVisitor *visitor) const;
 
-  const std::vector<std::string> &get_args() const { return args; }
+  llvm::ArrayRef<Symbol> get_args() const { return args; }
+
+  // copy into another arena, for prototypes that outlive their item
+  PrototypeAST *clone(Arena &arena) const;
 };
 
 // FunctionAST - This class represents a function definition itself.
 class FunctionAST {
-  std::unique_ptr<PrototypeAST> proto;
-  std::unique_ptr<ExprAST> body;
+  PrototypeAST *proto;
+  ExprAST *body;
+  unsigned frame_size; // slots, set by the Resolver
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> proto,
-              std::unique_ptr<ExprAST> body)
-      : proto(std::move(proto)), body(std::move(body)) {}
+  FunctionAST(PrototypeAST *proto, ExprAST *body)
+      : proto(proto), body(body), frame_size(0) {}
 
   llvm::Function *accept(NodeVisitor *visitor) const;
 
-  std::unique_ptr<PrototypeAST> get_proto() { return std::move(proto); }
+  const PrototypeAST *get_proto() const { return proto; }
+  PrototypeAST *get_proto() { return proto; }
+
+  const ExprAST *get_body() const { return body; }
+  ExprAST *get_body() { return body; }
+  void set_body(ExprAST *e) { body = e; }
 
-  const ExprAST *get_body() const { return body.get(); }
+  // variables live at once: the arguments, then the loop and var variables
+  // in scope
+  unsigned get_frame_size() const { return frame_size; }
+  void set_frame_size(unsigned n) { frame_size = n; }
 };
 } // namespace ast
 
@@ -0,0 +1,53 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <utility>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+namespace ast {
+// Arena - bump allocator that owns every node parsed for one top-level item.
+// Nodes are never destroyed one by one: they don't own any heap memory, so
+// releasing the arena frees the whole tree in one step.
+class Arena {
+  llvm::BumpPtrAllocator allocator;
+
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // constructs a T in the arena
+  template <typename T, typename... Args> T *make(Args &&... args) {
+    return new (allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  // copies an array into the arena
+  template <typename T> llvm::ArrayRef<T> copy(llvm::ArrayRef<T> xs) {
+    if (xs.empty())
+      return llvm::ArrayRef<T>();
+    T *mem = allocator.Allocate<T>(xs.size());
+    std::uninitialized_copy(xs.begin(), xs.end(), mem);
+    return llvm::ArrayRef<T>(mem, xs.size());
+  }
+
+  // copies a string into the arena
+  llvm::StringRef copy(llvm::StringRef str) {
+    if (str.empty())
+      return llvm::StringRef();
+    char *mem = allocator.Allocate<char>(str.size());
+    std::copy(str.begin(), str.end(), mem);
+    return llvm::StringRef(mem, str.size());
+  }
+
+  // frees every node at once, the first slab is kept for the next item
+  void reset() { allocator.Reset(); }
+
+  size_t bytes_allocated() const { return allocator.getBytesAllocated(); }
+};
+} // namespace ast
+
+#endif // ARENA_HPP
@@ -1,45 +1,60 @@
+#include <cmath>
 #include <iostream>
 
 #include "Codegen.hpp"
 #include "Error.hpp"
+#include "Optimizer.hpp"
 
-void Codegen::init_module_and_pass_mngr(void) {
-  //initializing data layout of the jit
-  module = std::make_unique<llvm::Module>("Kaleidescope", context);
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
-  module->setDataLayout(JIT->getTargetMachine().createDataLayout());
-  
-  FPM = std::make_unique<llvm::legacy::FunctionPassManager>(module.get());
-
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  FPM->add(llvm::createInstructionCombiningPass());
-
-  // Reassociate expressions.
-  FPM->add(llvm::createReassociatePass());
-
-  // Eliminate Common SubExpressions.
-  FPM->add(llvm::createNewGVNPass());
+void Codegen::init_module(void) {
+  // anything left of the previous module belongs to the previous context
+  module.reset();
+  builder.reset();
 
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  FPM->add(llvm::createCFGSimplificationPass());
+  ts_context = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+  context = ts_context.getContext();
+  builder = std::make_unique<llvm::IRBuilder<>>(*context);
+  builder->setFastMathFlags(fast_math_flags(fp_model));
+  module = std::make_unique<llvm::Module>("Kaleidescope", *context);
 
-  FPM->doInitialization();
+  //initializing data layout of the jit, or of the target ahead of time
+  if (JIT)
+    module->setDataLayout(JIT->getDataLayout());
+  else {
+    module->setDataLayout(TM->createDataLayout());
+    module->setTargetTriple(TM->getTargetTriple().str());
+  }
+  module_functions.clear();
+  top_level_chunks.clear();
+  top_level_end = nullptr;
 }
 
-llvm::Value *Codegen::visit(ast::NumberExprAST *node) {
-  return llvm::ConstantFP::get(context, llvm::APFloat(node->get_val()));
+llvm::Value *Codegen::visit(const ast::NumberExprAST *node) {
+  return llvm::ConstantFP::get(*context, llvm::APFloat(node->get_val()));
 }
 
 // VariableExprAST
-llvm::Value *Codegen::visit(ast::VariableExprAST *node) {
-  llvm::Value *val = named_values[node->get_name()];
-  if (!val)
-    return log_errorV("Unknown variable name");
-  return val;
+llvm::Value *Codegen::visit(const ast::VariableExprAST *node) {
+  // the resolver already bound the name to a slot
+  assert(node->get_slot() < named_values.size() && "unresolved variable");
+  auto alloca = named_values[node->get_slot()];
+  return builder->CreateLoad(alloca->getAllocatedType(), alloca,
+                             node->get_name().str());
 }
 
 // BinaryExprAST
-llvm::Value *Codegen::visit(ast::BinaryExprAST *node) {
+llvm::Value *Codegen::visit(const ast::BinaryExprAST *node) {
   auto L = node->get_lhs()->accept(this);
   auto R = node->get_rhs()->accept(this);
   if (!L || !R)
@@ -47,45 +62,67 @@ llvm::Value *Codegen::visit(ast::BinaryExprAST *node) {
 
   switch (node->get_op()) {
   case '+':
-    return builder.CreateFAdd(L, R, "addtmp");
+    return builder->CreateFAdd(L, R, "addtmp");
 
   case '-':
-    return builder.CreateFSub(L, R, "subtmp");
+    return builder->CreateFSub(L, R, "subtmp");
 
   case '*':
-    return builder.CreateFMul(L, R, "multmp");
+    return builder->CreateFMul(L, R, "multmp");
 
   case '<':
-    L = builder.CreateFCmpULT(L, R, "cmptmp");
-    return builder.CreateUIToFP(L, llvm::Type::getDoubleTy(context));
+    L = builder->CreateFCmpULT(L, R, "cmptmp");
+    return builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*context));
 
   default:
     return log_errorV("Invalid binary operator");
   }
 }
 
-llvm::Function *Codegen::get_func(const std::string& name) {
-  
+llvm::AllocaInst *Codegen::create_entry_alloca(llvm::Function *f,
+                                               llvm::StringRef name,
+                                               llvm::Type *type) {
+  llvm::IRBuilder<> entry(&f->getEntryBlock(), f->getEntryBlock().begin());
+  if (!type)
+    type = llvm::Type::getDoubleTy(*context);
+  return entry.CreateAlloca(type, nullptr, name);
+}
+
+llvm::Function *Codegen::get_func(unsigned id) {
+  // the first tier's callees, for its optimized version
+  if (tiered_jit && !building && id < current_tier.size() &&
+      current_tier[id] >= 0)
+    tier_callees.emplace_back(id, current_tier[id]);
+
   // check to see if the function is in this module
-  if (auto *f = module->getFunction(name))
-    return f;
+  if (id < module_functions.size() && module_functions[id])
+    return module_functions[id];
 
-  auto fi = function_protos.find(name);
-  if (fi != function_protos.end())
-    return fi->second->accept(this);
+  // otherwise declare it from its latest prototype
+  llvm::Function *f = functions.get(id).proto->accept(this);
 
-  return nullptr;
+  // an optimized version calls what its first tier calls, even if there are
+  // newer definitions by the time it is generated
+  if (building && id != building->id) {
+    auto it = llvm::find_if(building->callee_tiers,
+                            [&](const std::pair<unsigned, int> &callee) {
+                              return callee.first == id;
+                            });
+    if (it != building->callee_tiers.end())
+      f->setName(tier_alias(id, it->second));
+  }
+  return f;
 }
 
 // CallExprAST
-llvm::Value *Codegen::visit(ast::CallExprAST *node) {
-  llvm::Function *calleeF = get_func(node->get_callee());
-  if (!calleeF)
-    return log_errorV("Unknown function");
-
-  auto &args = node->get_args();
-  if (calleeF->arg_size() != args.size())
-    return log_errorV("Incorrect # arguments");
+llvm::Value *Codegen::visit(const ast::CallExprAST *node) {
+  // the resolver already checked the callee and its arity
+  unsigned id = node->get_callee_id();
+  llvm::Function *calleeF = get_func(id);
+  if (id != cur_function && !functions.get(id).pure)
+    body_pure = false;
+  auto args = node->get_args();
+  assert(calleeF->arg_size() == args.size() && "unresolved call");
 
   std::vector<llvm::Value *> argsV;
   for (unsigned i = 0, e = args.size(); i != e; i++) {
@@ -94,78 +131,1235 @@ llvm::Value *Codegen::visit(ast::CallExprAST *node) {
       return nullptr;
   }
 
-  return builder.CreateCall(calleeF, argsV, "calltmp");
+  // late bound: whatever definition the slot holds when the call is made,
+  // even for a function that is only declared so far. Until one is
+  // published, an extern of the host process is called directly and
+  // anything else traps rather than jump to null
+  if (concurrent) {
+    auto slot_ptr = builder->CreateIntToPtr(
+        builder->getInt64((uint64_t)(uintptr_t)&slot(id)),
+        calleeF->getType()->getPointerTo());
+    llvm::Value *target = builder->CreateAlignedLoad(
+        calleeF->getType(), slot_ptr, llvm::Align(8), "callee");
+    llvm::cast<llvm::LoadInst>(target)->setAtomic(
+        llvm::AtomicOrdering::Acquire);
+    auto published = builder->CreateIsNotNull(target, "published");
+    if (llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            calleeF->getName().str())) {
+      target = builder->CreateSelect(published, target, calleeF);
+    } else {
+      llvm::Function *f = builder->GetInsertBlock()->getParent();
+      auto call_bb = llvm::BasicBlock::Create(*context, "call", f);
+      auto trap_bb = llvm::BasicBlock::Create(*context, "unpublished", f);
+      builder->CreateCondBr(
+          published, call_bb, trap_bb,
+          llvm::MDBuilder(*context).createBranchWeights(1 << 20, 1));
+      builder->SetInsertPoint(trap_bb);
+      builder->CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+      builder->CreateUnreachable();
+      builder->SetInsertPoint(call_bb);
+    }
+    return builder->CreateCall(calleeF->getFunctionType(), target, argsV,
+                               "calltmp");
+  }
+
+  return builder->CreateCall(calleeF, argsV, "calltmp");
+}
+
+// IfExprAST
+llvm::Value *Codegen::visit(const ast::IfExprAST *node) {
+  auto cond = node->get_cond()->accept(this);
+  if (!cond)
+    return nullptr;
+
+  // true unless 0.0 or NaN
+  auto zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+  cond = builder->CreateFCmpONE(cond, zero, "ifcond");
+
+  llvm::Function *f = builder->GetInsertBlock()->getParent();
+  auto then_bb = llvm::BasicBlock::Create(*context, "then", f);
+  auto else_bb = llvm::BasicBlock::Create(*context, "else", f);
+  auto merge_bb = llvm::BasicBlock::Create(*context, "ifcont", f);
+  builder->CreateCondBr(cond, then_bb, else_bb);
+
+  // either branch may have added blocks, the phi takes the last ones
+  builder->SetInsertPoint(then_bb);
+  auto then = node->get_then()->accept(this);
+  if (!then)
+    return nullptr;
+  builder->CreateBr(merge_bb);
+  then_bb = builder->GetInsertBlock();
+
+  builder->SetInsertPoint(else_bb);
+  auto els = node->get_else()->accept(this);
+  if (!els)
+    return nullptr;
+  builder->CreateBr(merge_bb);
+  else_bb = builder->GetInsertBlock();
+
+  builder->SetInsertPoint(merge_bb);
+  auto phi =
+      builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, "iftmp");
+  phi->addIncoming(then, then_bb);
+  phi->addIncoming(els, else_bb);
+  return phi;
+}
+
+namespace {
+// whether expr is an integer constant that a double holds exactly, and
+// which one
+bool get_integer(const ast::ExprAST *expr, int64_t &value) {
+  auto num = llvm::dyn_cast<ast::NumberExprAST>(expr);
+  if (!num)
+    return false;
+  double v = num->get_val();
+  // -0.0 would come back from the integer as 0.0
+  if (!(std::fabs(v) <= 9007199254740992.0) || v != std::trunc(v) ||
+      (v == 0 && std::signbit(v)))
+    return false;
+  value = (int64_t)v;
+  return true;
+}
+} // namespace
+
+// ForExprAST
+llvm::Value *Codegen::visit(const ast::ForExprAST *node) {
+  // a loop that never assigns its variable and counts from an integer by an
+  // integer counts in an i64, which SCEV can find the trip count of. The
+  // variable is the count as a double, exact until it passes 2^53.
+  int64_t start_int, step_int = 1;
+  bool counted =
+      !node->is_assigned() && get_integer(node->get_start(), start_int) &&
+      (!node->get_step() || get_integer(node->get_step(), step_int));
+
+  auto start = node->get_start()->accept(this);
+  if (!start)
+    return nullptr;
+
+  // the condition is tested before every iteration, loop rotation turns it
+  // into the do-while form the loop passes want
+  llvm::Function *f = builder->GetInsertBlock()->getParent();
+  unsigned slot = node->get_slot();
+  auto var = create_entry_alloca(f, node->get_var().str());
+  builder->CreateStore(start, var);
+  named_values[slot] = var;
+
+  auto i64 = builder->getInt64Ty();
+  llvm::AllocaInst *count = nullptr;
+  std::string count_name = (node->get_var().str() + ".count").str();
+  if (counted) {
+    count = create_entry_alloca(f, count_name, i64);
+    builder->CreateStore(builder->getInt64(start_int), count);
+  }
+
+  auto cond_bb = llvm::BasicBlock::Create(*context, "loop.cond", f);
+  auto body_bb = llvm::BasicBlock::Create(*context, "loop.body", f);
+  auto end_bb = llvm::BasicBlock::Create(*context, "loop.end", f);
+  builder->CreateBr(cond_bb);
+
+  builder->SetInsertPoint(cond_bb);
+  llvm::Value *i = nullptr;
+  if (counted) {
+    i = builder->CreateLoad(i64, count, count_name);
+    builder->CreateStore(
+        builder->CreateSIToFP(i, llvm::Type::getDoubleTy(*context)), var);
+  }
+
+  // a counted loop compares its count with the bound itself: i < e exactly
+  // when i < ceil(e), e < i when floor(e) < i, and both hold if e is NaN
+  llvm::Value *cond = nullptr;
+  auto cmp = llvm::dyn_cast<ast::BinaryExprAST>(node->get_end());
+  if (counted && cmp && cmp->get_op() == '<') {
+    auto is_var = [&](const ast::ExprAST *e) {
+      auto v = llvm::dyn_cast<ast::VariableExprAST>(e);
+      return v && v->get_slot() == slot;
+    };
+    bool below = is_var(cmp->get_lhs());
+    if (below != is_var(cmp->get_rhs())) {
+      auto bound = (below ? cmp->get_rhs() : cmp->get_lhs())->accept(this);
+      if (!bound)
+        return nullptr;
+      auto rounded = builder->CreateUnaryIntrinsic(
+          below ? llvm::Intrinsic::ceil : llvm::Intrinsic::floor, bound);
+      llvm::Value *limit = builder->CreateIntrinsic(
+          llvm::Intrinsic::fptosi_sat, {i64, rounded->getType()}, {rounded});
+      auto all = below ? llvm::APInt::getSignedMaxValue(64)
+                       : llvm::APInt::getSignedMinValue(64);
+      limit = builder->CreateSelect(builder->CreateFCmpUNO(bound, bound),
+                                    builder->getInt(all), limit, "limit");
+      cond = below ? builder->CreateICmpSLT(i, limit, "loopcond")
+                   : builder->CreateICmpSGT(i, limit, "loopcond");
+    }
+  }
+  if (!cond) {
+    auto end = node->get_end()->accept(this);
+    if (!end)
+      return nullptr;
+    auto zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+    cond = builder->CreateFCmpONE(end, zero, "loopcond");
+  }
+  builder->CreateCondBr(cond, body_bb, end_bb);
+
+  builder->SetInsertPoint(body_bb);
+  if (!node->get_body()->accept(this))
+    return nullptr;
+
+  if (counted) {
+    builder->CreateStore(
+        builder->CreateAdd(i, builder->getInt64(step_int), "nextvar"), count);
+  } else {
+    llvm::Value *step = llvm::ConstantFP::get(*context, llvm::APFloat(1.0));
+    if (node->get_step()) {
+      step = node->get_step()->accept(this);
+      if (!step)
+        return nullptr;
+    }
+    // the body or the step may have assigned the variable
+    auto cur = builder->CreateLoad(var->getAllocatedType(), var,
+                                   node->get_var().str());
+    builder->CreateStore(builder->CreateFAdd(cur, step, "nextvar"), var);
+  }
+  builder->CreateBr(cond_bb);
+
+  builder->SetInsertPoint(end_bb);
+  return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*context));
+}
+
+// VarExprAST
+llvm::Value *Codegen::visit(const ast::VarExprAST *node) {
+  llvm::Function *f = builder->GetInsertBlock()->getParent();
+  unsigned slot = node->get_slot();
+  for (unsigned i = 0; i < node->get_names().size(); i++) {
+    auto init = node->get_inits()[i];
+    llvm::Value *value =
+        init ? init->accept(this)
+             : llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+    if (!value)
+      return nullptr;
+
+    // bound after its initial value, which may use an outer variable of the
+    // same name
+    auto var = create_entry_alloca(f, node->get_names()[i].str());
+    builder->CreateStore(value, var);
+    named_values[slot + i] = var;
+  }
+  return node->get_body()->accept(this);
+}
+
+// AssignExprAST
+llvm::Value *Codegen::visit(const ast::AssignExprAST *node) {
+  auto value = node->get_value()->accept(this);
+  if (!value)
+    return nullptr;
+  builder->CreateStore(value, named_values[node->get_var()->get_slot()]);
+  return value;
 }
 
 // PrototypeAST
-llvm::Function *Codegen::visit(ast::PrototypeAST *node) {
-  auto &args = node->get_args();
+llvm::Function *Codegen::visit(const ast::PrototypeAST *node) {
+  unsigned id = node->get_id();
+  if (id < module_functions.size() && module_functions[id])
+    return module_functions[id];
+
+  auto args = node->get_args();
   std::vector<llvm::Type *> doubles(args.size(),
-                                    llvm::Type::getDoubleTy(context));
+                                    llvm::Type::getDoubleTy(*context));
 
   llvm::FunctionType *ft =
-      llvm::FunctionType::get(llvm::Type::getDoubleTy(context), doubles, false);
+      llvm::FunctionType::get(llvm::Type::getDoubleTy(*context), doubles, false);
 
   llvm::Function *f = llvm::Function::Create(
-      ft, llvm::Function::ExternalLinkage, node->get_name(), module.get());
+      ft, llvm::Function::ExternalLinkage, node->get_name().str(),
+      module.get());
+  set_fp_model(*f, fp_model);
 
   unsigned idx = 0;
   for (auto &arg : f->args())
-    arg.setName(args[idx++]);
+    arg.setName(args[idx++].str());
 
+  if (id >= module_functions.size())
+    module_functions.resize(id + 1);
+  module_functions[id] = f;
   return f;
 }
 
 // FunctionAST
-llvm::Function *Codegen::visit(ast::FunctionAST *node) {
-  
-  auto tmp = std::move(node->get_proto());
-  auto &p = *(tmp.get());
-  function_protos[p.get_name()] = std::move(tmp);
-  
-  // checking to see if function already exist
-  llvm::Function *f = get_func(p.get_name());
+llvm::Function *Codegen::visit(const ast::FunctionAST *node) {
+  Stats::Timer timer(stats, Stats::codegen);
+
+  // a redefinition within the same module (ahead of time, the whole file is
+  // one module), see set_aside()
+  unsigned id = node->get_proto()->get_id();
+  llvm::Function *old = set_aside(id);
+  llvm::Function *f = get_func(id);
   if (!f)
     return nullptr;
   
   // setting entry point for function
-  llvm::BasicBlock *bb = llvm::BasicBlock::Create(context, "entry", f);
-  builder.SetInsertPoint(bb);
+  llvm::BasicBlock *bb = llvm::BasicBlock::Create(*context, "entry", f);
+  builder->SetInsertPoint(bb);
 
-  // adding args to symbol table
+  // adding args to symbol table, the other variables come after them; every
+  // argument gets a stack slot, since it may be assigned
   named_values.clear();
-  for (auto &arg : f->args())
-    named_values[arg.getName().str()] = &arg;
+  for (auto &arg : f->args()) {
+    auto alloca = create_entry_alloca(f, arg.getName());
+    builder->CreateStore(&arg, alloca);
+    named_values.push_back(alloca);
+  }
+  named_values.resize(node->get_frame_size());
 
+  cur_function = id;
+  body_pure = true;
+  tier_callees.clear();
   if (llvm::Value *ret = node->get_body()->accept(this)) {
-    builder.CreateRet(ret);
+    builder->CreateRet(ret);
+    // counting cycles needs code after every call that returns
+    if (!profile || !profile->counts_cycles())
+      mark_tail_calls(f);
     llvm::verifyFunction(*f);
-    FPM->run(*f);
+    if (!linking && memoized.count(f->getName()))
+      memoize(f, id);
+    // top-level expressions run once and are gone
+    bool top_level = is_top_level(f);
+    if (profile && !top_level) {
+      if (profile->counts_calls())
+        instrument(f, id);
+      apply_profile(f);
+    }
+    if (tiered_jit && !linking && !building && !top_level)
+      add_tier_check(f, make_tier(node, id));
     return f;
   }
 
-  // delete function incase user mistyped
-  f->eraseFromParent();
+  // delete function incase user mistyped; a failed redefinition leaves the
+  // old one in place, and earlier code in the module may still call it, then
+  // only the body goes
+  if (old)
+    restore(id, old);
+  else if (f->use_empty()) {
+    f->eraseFromParent();
+    module_functions[id] = nullptr;
+  } else
+    f->deleteBody();
   return nullptr;
 }
 
-void Codegen::add_module() {
-  JIT->addModule(std::move(module));  
+llvm::Function *Codegen::set_aside(unsigned id) {
+  if (id >= module_functions.size() || !module_functions[id] ||
+      module_functions[id]->empty())
+    return nullptr;
+  llvm::Function *old = module_functions[id];
+  old->setName(old->getName() + ".old");
+  old->setLinkage(llvm::Function::InternalLinkage);
+  module_functions[id] = nullptr;
+  return old;
+}
+
+void Codegen::restore(unsigned id, llvm::Function *old) {
+  std::string name = functions.get(id).name.str().str();
+  if (llvm::Function *f = module_functions[id]) {
+    f->replaceAllUsesWith(old);
+    f->eraseFromParent();
+  }
+  old->setName(name);
+  old->setLinkage(llvm::Function::ExternalLinkage);
+  module_functions[id] = old;
+}
+
+llvm::Function *Codegen::generate(const ast::FunctionAST *node,
+                                  llvm::ArrayRef<unsigned> dependents) {
+  // the dependents' bodies go first, so that node calls their new ones
+  // wherever there is a cycle
+  std::vector<std::pair<unsigned, llvm::Function *>> old;
+  for (unsigned id : dependents)
+    if (llvm::Function *f = set_aside(id))
+      old.push_back({id, f});
+
+  llvm::Function *f = node->accept(this);
+  if (!f) {
+    for (auto &entry : old)
+      restore(entry.first, entry.second);
+    return nullptr;
+  }
+  return f;
+}
+
+void Codegen::regenerate(llvm::ArrayRef<unsigned> dependents) {
+  // each of them was generated from the same AST before, so it can't fail
+  for (unsigned id : dependents)
+    functions.get(id).def->accept(this);
 }
 
-void Codegen::store_proto(const std::string& name, std::unique_ptr<ast::PrototypeAST> ptr) {
-  function_protos[name] = std::move(ptr);
+llvm::orc::ThreadSafeModule Codegen::take_module() {
+  if (whole_program && opt_level > 0)
+    link_callee_bodies();
+  return llvm::orc::ThreadSafeModule(std::move(module), ts_context);
+}
+
+void Codegen::link_callee_bodies() {
+  // copies are only there to be inlined, they don't get a memo table
+  linking = true;
+  std::vector<bool> seen(functions.size());
+  // every body linked in may declare more callees, go round until none do
+  for (bool linked = true; linked;) {
+    linked = false;
+    for (unsigned id = 0; id < module_functions.size(); id++) {
+      llvm::Function *f = module_functions[id];
+      if (!f || !f->isDeclaration() || seen[id])
+        continue;
+      seen[id] = true;
+
+      // the JIT'd code of a function keeps calling the definitions it was
+      // compiled against; a copy generated now would call the newest ones,
+      // so only functions none of whose callees were redefined since qualify
+      auto &info = functions.get(id);
+      if (info.def && !functions.is_stale(id) && info.def->accept(this)) {
+        f->setLinkage(llvm::Function::AvailableExternallyLinkage);
+        linked = true;
+      }
+    }
+  }
+  linking = false;
+}
+
+void Codegen::print_optimized(const llvm::Function *f) {
+  // the bodies take_module() links in are what the inliner sees
+  if (whole_program && opt_level > 0)
+    link_callee_bodies();
+  auto copy = llvm::CloneModule(*module);
+  if (auto err = JIT->optimize(*copy)) {
+    llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), "Error: ");
+    return;
+  }
+  copy->getFunction(f->getName())->print(llvm::errs());
+}
+
+llvm::orc::KaleidoscopeJIT::ModuleKey Codegen::add_module() {
+  return JIT->addModule(take_module());
+}
+
+void Codegen::remove_module(llvm::orc::KaleidoscopeJIT::ModuleKey key) {
+  JIT->removeModule(key);
 }
 
 void Codegen::eval() {
-  auto h = JIT->addModule(std::move(module));
-  init_module_and_pass_mngr();
+  auto h = JIT->addModule(take_module());
+  init_module();
 
-  auto expr_sym = JIT->findSymbol("__anon_expr");
-  assert(expr_sym && "Function not found");
-  
-  double (*fp)() = (double (*)())(intptr_t)cantFail(expr_sym.getAddress());
-  std::cout << "Evaluated to: " << fp() << "\n";
+  auto expr_sym = JIT->lookup("__anon_expr");
+  if (!expr_sym) {
+    llvm::logAllUnhandledErrors(expr_sym.takeError(), llvm::errs(),
+                                "Error: ");
+    JIT->removeModule(h);
+    return;
+  }
+
+  double (*fp)() = (double (*)())(intptr_t)expr_sym->getAddress();
+  double result;
+  {
+    Stats::Timer timer(stats, Stats::execute);
+    result = fp();
+  }
+  std::cout << "Evaluated to: " << result << "\n";
 
   JIT->removeModule(h);
 }
+
+void Codegen::eval_top_level() {
+  std::string name = finish_top_level()->getName().str();
+  add_module();
+  init_module();
+
+  auto sym = JIT->lookup(name);
+  if (!sym) {
+    llvm::logAllUnhandledErrors(sym.takeError(), llvm::errs(), "Error: ");
+    return;
+  }
+  int (*fp)() = (int (*)())(intptr_t)sym->getAddress();
+  Stats::Timer timer(stats, Stats::execute);
+  fp();
+}
+
+void *Codegen::compile_function(unsigned id) {
+  // collect everything reachable from id that is still interpreted
+  std::vector<unsigned> todo, stack{id};
+  std::vector<bool> seen(functions.size());
+  while (!stack.empty()) {
+    unsigned i = stack.back();
+    stack.pop_back();
+
+    auto &info = functions.get(i);
+    if (seen[i] || !info.def || info.addr)
+      continue;
+    seen[i] = true;
+    todo.push_back(i);
+    stack.insert(stack.end(), info.callees.begin(), info.callees.end());
+  }
+
+  // one module for the whole batch, dropped if any of them fails
+  for (unsigned i : todo) {
+    if (!functions.get(i).def->accept(this)) {
+      init_module();
+      return nullptr;
+    }
+  }
+  add_module();
+  init_module();
+
+  for (unsigned i : todo)
+    functions.get(i).addr = get_address(i);
+  return functions.get(id).addr;
+}
+
+Codegen::BatchFunction Codegen::get_batch_function(unsigned id) {
+  auto &info = functions.get(id);
+  if (!JIT || !info.def || concurrent)
+    return nullptr;
+  // the wrapper goes into a module of its own, which can only link against
+  // definitions the JIT has, so the ones still waiting in the current module
+  // go first
+  for (llvm::Function *pending : module_functions)
+    if (pending && !pending->isDeclaration()) {
+      add_module();
+      init_module();
+      break;
+    }
+
+  if (id >= batch_functions.size())
+    batch_functions.resize(id + 1);
+  auto &cached = batch_functions[id];
+  if (cached.addr && cached.version == info.version)
+    return cached.addr;
+  free_batch_function(id);
+
+  // the same context, so the builder carries over
+  llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+  auto pending = std::move(module);
+  auto pending_functions = std::move(module_functions);
+  module = std::make_unique<llvm::Module>("Kaleidescope.batch", *context);
+  module->setDataLayout(JIT->getDataLayout());
+  module_functions.clear();
+
+  auto dbl = builder->getDoubleTy();
+  auto i64 = builder->getInt64Ty();
+  auto column_ty = dbl->getPointerTo();
+
+  llvm::Function *f = get_func(id);
+  std::string name =
+      (f->getName() + ".batch." + llvm::Twine(info.version)).str();
+  llvm::Function *wrapper = llvm::Function::Create(
+      llvm::FunctionType::get(builder->getVoidTy(),
+                              {column_ty->getPointerTo(), column_ty, i64},
+                              false),
+      llvm::Function::ExternalLinkage, name, module.get());
+  set_fp_model(*wrapper, fp_model);
+  wrapper->addParamAttr(0, llvm::Attribute::NoAlias);
+  wrapper->addParamAttr(1, llvm::Attribute::NoAlias);
+  auto arg = wrapper->arg_begin();
+  llvm::Value *columns = arg++, *results = arg++, *rows = arg++;
+
+  auto entry_bb = llvm::BasicBlock::Create(*context, "entry", wrapper);
+  auto loop_bb = llvm::BasicBlock::Create(*context, "loop", wrapper);
+  auto exit_bb = llvm::BasicBlock::Create(*context, "exit", wrapper);
+
+  builder->SetInsertPoint(entry_bb);
+  llvm::SmallVector<llvm::Value *, 8> column_ptrs;
+  for (unsigned j = 0; j < f->arg_size(); j++)
+    column_ptrs.push_back(builder->CreateLoad(
+        column_ty, builder->CreateConstInBoundsGEP1_64(column_ty, columns, j)));
+  builder->CreateCondBr(builder->CreateICmpEQ(rows, builder->getInt64(0)),
+                        exit_bb, loop_bb);
+
+  builder->SetInsertPoint(loop_bb);
+  auto i = builder->CreatePHI(i64, 2, "i");
+  i->addIncoming(builder->getInt64(0), entry_bb);
+  llvm::SmallVector<llvm::Value *, 8> args;
+  for (auto column : column_ptrs)
+    args.push_back(
+        builder->CreateLoad(dbl, builder->CreateInBoundsGEP(dbl, column, i)));
+  builder->CreateStore(builder->CreateCall(f, args, "result"),
+                       builder->CreateInBoundsGEP(dbl, results, i));
+  auto next = builder->CreateAdd(i, builder->getInt64(1), "next", true, true);
+  i->addIncoming(next, loop_bb);
+  builder->CreateCondBr(builder->CreateICmpEQ(next, rows), exit_bb, loop_bb);
+
+  builder->SetInsertPoint(exit_bb);
+  builder->CreateRetVoid();
+  llvm::verifyFunction(*wrapper);
+
+  // the body has to be inlined into the loop for it to vectorize, so the
+  // wrapper gets the full pipeline even where other modules get less
+  link_callee_bodies();
+  if (!f->isDeclaration())
+    f->addFnAttr(llvm::Attribute::AlwaysInline);
+  set_opt_level(*module, opt_level);
+
+  auto key = JIT->addModule(
+      llvm::orc::ThreadSafeModule(std::move(module), ts_context));
+  module = std::move(pending);
+  module_functions = std::move(pending_functions);
+
+  auto sym = JIT->lookup(name);
+  if (!sym) {
+    llvm::logAllUnhandledErrors(sym.takeError(), llvm::errs(), "Error: ");
+    JIT->removeModule(key);
+    return nullptr;
+  }
+  cached.version = info.version;
+  cached.addr = (BatchFunction)(intptr_t)sym->getAddress();
+  cached.key = key;
+  return cached.addr;
+}
+
+void Codegen::free_batch_function(unsigned id) {
+  if (id >= batch_functions.size() || !batch_functions[id].key)
+    return;
+  JIT->removeModule(batch_functions[id].key);
+  batch_functions[id] = BatchEntry();
+}
+
+bool Codegen::compile_callees(llvm::ArrayRef<unsigned> ids) {
+  for (unsigned id : ids) {
+    auto &info = functions.get(id);
+    if (info.def && !info.addr && !compile_function(id))
+      return false;
+  }
+  return true;
+}
+
+void *Codegen::get_address(unsigned id) {
+  auto sym = JIT->lookup(functions.get(id).name.str());
+  if (!sym) {
+    // a function that isn't there is for the caller to handle, anything else
+    // went wrong in the JIT
+    llvm::handleAllErrors(
+        sym.takeError(), [](const llvm::orc::SymbolsNotFound &) {},
+        [](const llvm::ErrorInfoBase &err) {
+          llvm::errs() << "Error: " << err.message() << "\n";
+        });
+    return nullptr;
+  }
+  return (void *)(intptr_t)sym->getAddress();
+}
+
+std::atomic<void *> &Codegen::slot(unsigned id) {
+  while (slots.size() <= id)
+    slots.emplace_back();
+  return slots[id];
+}
+
+const std::atomic<void *> *Codegen::get_slot(unsigned id) const {
+  if (id >= slots.size() || !slots[id].load(std::memory_order_relaxed))
+    return nullptr;
+  return &slots[id];
+}
+
+bool Codegen::publish(unsigned id) {
+  void *addr = get_address(id);
+  if (!addr)
+    return false;
+  slot(id).store(addr, std::memory_order_seq_cst);
+  return true;
+}
+
+void Codegen::print_cache_stats() {
+  if (!JIT)
+    return;
+  if (auto cache = JIT->getObjectCache())
+    cache->print_stats(llvm::errs());
+}
+
+std::unique_ptr<llvm::TargetMachine>
+Codegen::create_host_target_machine(unsigned opt_level,
+                                    ast::Options::FPModel fp_model,
+                                    const std::string &cpu,
+                                    llvm::ArrayRef<std::string> cpu_features) {
+  std::string triple = llvm::sys::getProcessTriple(), err;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, err);
+  if (!target) {
+    llvm::errs() << "Error: " << err << "\n";
+    std::exit(1);
+  }
+
+  llvm::SubtargetFeatures features;
+  llvm::StringMap<bool> host_features;
+  if (llvm::sys::getHostCPUFeatures(host_features))
+    for (auto &feature : host_features)
+      features.AddFeature(feature.first(), feature.second);
+  std::string target_cpu = llvm::sys::getHostCPUName().str();
+  select_cpu(target_cpu, features, cpu, cpu_features);
+
+  llvm::TargetOptions options;
+  set_fp_model(options, fp_model);
+
+  // position independent, so the object links into a PIE by default
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, target_cpu, features.getString(), options,
+      llvm::Reloc::PIC_, llvm::None,
+      codegen_opt_level(opt_level)));
+}
+
+bool Codegen::add_top_level(const ast::FunctionAST *node) {
+  Stats::Timer timer(stats, Stats::codegen);
+  if (top_level_chunks.empty() || top_level_count == top_level_chunk) {
+    if (!top_level_chunks.empty())
+      finish_top_level_chunk();
+    llvm::Function *chunk = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context), false),
+        llvm::Function::InternalLinkage, "top_level.chunk", module.get());
+    set_fp_model(*chunk, fp_model);
+    top_level_chunks.push_back(chunk);
+    top_level_end = llvm::BasicBlock::Create(*context, "entry", chunk);
+    top_level_count = 0;
+  }
+  llvm::Function *chunk = top_level_chunks.back();
+
+  llvm::BasicBlock *bb = llvm::BasicBlock::Create(*context, "expr", chunk);
+  builder->SetInsertPoint(bb);
+  named_values.assign(node->get_frame_size(), nullptr);
+
+  llvm::Value *value = node->get_body()->accept(this);
+  if (!value) {
+    // drop whatever was generated before the error, and the variables it
+    // allocated
+    for (auto it = bb->getIterator(), e = chunk->end(); it != e; ++it)
+      it->dropAllReferences();
+    while (&chunk->back() != top_level_end)
+      chunk->back().eraseFromParent();
+    auto &entry = chunk->getEntryBlock();
+    for (auto it = entry.begin(); it != entry.end();) {
+      auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*it++);
+      if (alloca && alloca->use_empty())
+        alloca->eraseFromParent();
+    }
+    return false;
+  }
+
+  // same output as the REPL: %g matches what the REPL's ostream prints
+  auto printf_fn = module->getOrInsertFunction(
+      "printf",
+      llvm::FunctionType::get(llvm::Type::getInt32Ty(*context),
+                              {llvm::Type::getInt8PtrTy(*context)}, true));
+  auto format = module->getNamedGlobal("top_level.format");
+  builder->CreateCall(
+      printf_fn,
+      {format ? builder->CreateConstInBoundsGEP2_32(format->getValueType(),
+                                                    format, 0, 0)
+              : builder->CreateGlobalStringPtr("Evaluated to: %g\n",
+                                               "top_level.format"),
+       value});
+
+  llvm::BasicBlock *end = builder->GetInsertBlock();
+  builder->SetInsertPoint(top_level_end);
+  builder->CreateBr(bb);
+  top_level_end = end;
+  top_level_count++;
+  return true;
+}
+
+void Codegen::finish_top_level_chunk() {
+  builder->SetInsertPoint(top_level_end);
+  builder->CreateRetVoid();
+  llvm::verifyFunction(*top_level_chunks.back());
+}
+
+llvm::Function *Codegen::finish_top_level() {
+  if (!top_level_chunks.empty())
+    finish_top_level_chunk();
+
+  auto int_ty = llvm::Type::getInt32Ty(*context);
+  llvm::Function *f = llvm::Function::Create(
+      llvm::FunctionType::get(int_ty, false), llvm::Function::ExternalLinkage,
+      top_level_name, module.get());
+  set_fp_model(*f, fp_model);
+  builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", f));
+  for (auto *chunk : top_level_chunks)
+    builder->CreateCall(chunk);
+  builder->CreateRet(llvm::ConstantInt::get(int_ty, 0));
+
+  top_level_chunks.clear();
+  top_level_end = nullptr;
+  return f;
+}
+
+bool Codegen::emit_object(const std::string &path, bool internalize) {
+  finish_top_level();
+
+  if (internalize)
+    for (auto &f : *module)
+      if (!f.isDeclaration() && f.getName() != "main")
+        f.setLinkage(llvm::Function::InternalLinkage);
+
+  if (llvm::verifyModule(*module, &llvm::errs()))
+    return false;
+
+  // whole-module optimization: everything is visible at once, so calls can
+  // be inlined and unused definitions dropped
+  optimize_module(*module, TM.get(), opt_level, stats);
+
+  std::error_code err;
+  llvm::raw_fd_ostream out(path, err, llvm::sys::fs::OF_None);
+  if (err) {
+    llvm::errs() << "Error: cannot open " << path << ": " << err.message()
+                 << "\n";
+    return false;
+  }
+
+  llvm::legacy::PassManager emit_passes;
+  if (TM->addPassesToEmitFile(emit_passes, out, nullptr,
+                              llvm::CGFT_ObjectFile)) {
+    llvm::errs() << "Error: the target cannot emit object files\n";
+    return false;
+  }
+  {
+    Stats::Timer timer(stats, Stats::emit);
+    emit_passes.run(*module);
+  }
+  out.flush();
+  if (stats)
+    stats->object_bytes += out.tell();
+  return true;
+}
+
+void Codegen::memoize(llvm::Function *f, unsigned id) {
+  if (!body_pure) {
+    llvm::errs() << "Error: " << f->getName()
+                 << " calls an extern or an impure function, not memoizing "
+                    "it\n";
+    return;
+  }
+  // every call would go through the table and back, so tail recursion
+  // would need a frame per call
+  for (auto &bb : *f)
+    for (auto &inst : bb)
+      if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+        if (call->isTailCall() && call->getCalledFunction() == f) {
+          llvm::errs() << "Error: " << f->getName()
+                       << " calls itself in tail position, not memoizing "
+                          "it\n";
+          return;
+        }
+
+  auto i64 = builder->getInt64Ty();
+  auto dbl = builder->getDoubleTy();
+  unsigned n = f->arg_size();
+
+  // the body moves to f.impl, f becomes the lookup in front of it
+  llvm::Function *impl =
+      llvm::Function::Create(f->getFunctionType(), llvm::Function::InternalLinkage,
+                             f->getName() + ".impl", module.get());
+  set_fp_model(*impl, fp_model);
+  impl->getBasicBlockList().splice(impl->begin(), f->getBasicBlockList());
+  for (auto args : llvm::zip(f->args(), impl->args())) {
+    std::get<0>(args).replaceAllUsesWith(&std::get<1>(args));
+    std::get<1>(args).setName(std::get<0>(args).getName());
+  }
+
+  // entries are {sequence, argument bits, result bits}. The sequence is odd
+  // while a thread writes the entry, and advances by two each time; zero
+  // means empty
+  auto key_ty = llvm::ArrayType::get(i64, n);
+  auto entry_ty = llvm::StructType::get(*context, {i64, key_ty, i64});
+  auto table_ty = llvm::ArrayType::get(entry_ty, memo_size);
+  auto table = new llvm::GlobalVariable(
+      *module, table_ty, false, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(table_ty), f->getName() + ".memo");
+
+  MemoStats *stats = nullptr;
+  if (memo_stats) {
+    if (id >= memo_counters.size())
+      memo_counters.resize(id + 1);
+    if (!memo_counters[id])
+      memo_counters[id] = std::make_unique<MemoStats>();
+    stats = memo_counters[id].get();
+  }
+  auto count = [&](std::atomic<uint64_t> *counter) {
+    if (!counter)
+      return;
+    auto ptr = builder->CreateIntToPtr(builder->getInt64((uintptr_t)counter),
+                                       i64->getPointerTo());
+    builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, ptr,
+                             builder->getInt64(1), llvm::MaybeAlign(8),
+                             llvm::AtomicOrdering::Monotonic);
+  };
+  auto load = [&](llvm::Value *ptr, llvm::AtomicOrdering order) {
+    auto value = builder->CreateLoad(i64, ptr);
+    value->setAtomic(order);
+    return value;
+  };
+  auto store = [&](llvm::Value *value, llvm::Value *ptr,
+                   llvm::AtomicOrdering order) {
+    builder->CreateStore(value, ptr)->setAtomic(order);
+  };
+
+  auto entry_bb = llvm::BasicBlock::Create(*context, "entry", f);
+  auto check_bb = llvm::BasicBlock::Create(*context, "check", f);
+  auto hit_bb = llvm::BasicBlock::Create(*context, "hit", f);
+  auto miss_bb = llvm::BasicBlock::Create(*context, "miss", f);
+  auto claim_bb = llvm::BasicBlock::Create(*context, "claim", f);
+  auto fill_bb = llvm::BasicBlock::Create(*context, "fill", f);
+  auto done_bb = llvm::BasicBlock::Create(*context, "done", f);
+
+  // hash the bit patterns of the arguments, so -0.0 and NaNs are keys like
+  // any other
+  builder->SetInsertPoint(entry_bb);
+  llvm::SmallVector<llvm::Value *, 8> keys;
+  llvm::Value *h = builder->getInt64(0xcbf29ce484222325ULL);
+  for (auto &arg : f->args()) {
+    keys.push_back(builder->CreateBitCast(&arg, i64));
+    h = builder->CreateMul(builder->CreateXor(h, keys.back()),
+                           builder->getInt64(0x100000001b3ULL));
+  }
+  h = builder->CreateXor(h, builder->CreateLShr(h, 33));
+  h = builder->CreateMul(h, builder->getInt64(0xff51afd7ed558ccdULL));
+  h = builder->CreateXor(h, builder->CreateLShr(h, 33));
+  auto index = builder->CreateAnd(h, builder->getInt64(memo_size - 1));
+  auto entry = builder->CreateInBoundsGEP(table_ty, table,
+                                          {builder->getInt64(0), index});
+  auto seq_ptr = builder->CreateStructGEP(entry_ty, entry, 0);
+  auto key_array = builder->CreateStructGEP(entry_ty, entry, 1);
+  auto result_ptr = builder->CreateStructGEP(entry_ty, entry, 2);
+  auto seq = load(seq_ptr, llvm::AtomicOrdering::Acquire);
+  // filled, and not being written
+  auto readable = builder->CreateAnd(
+      builder->CreateICmpNE(seq, builder->getInt64(0)),
+      builder->CreateICmpEQ(builder->CreateAnd(seq, 1), builder->getInt64(0)));
+  builder->CreateCondBr(readable, check_bb, miss_bb);
+
+  // the entry was read whole if its sequence is still the same afterwards
+  builder->SetInsertPoint(check_bb);
+  llvm::Value *same = builder->getTrue();
+  for (unsigned i = 0; i < n; i++) {
+    auto key = load(builder->CreateConstInBoundsGEP2_32(key_ty, key_array, 0, i),
+                    llvm::AtomicOrdering::Monotonic);
+    same = builder->CreateAnd(same, builder->CreateICmpEQ(key, keys[i]));
+  }
+  auto cached = load(result_ptr, llvm::AtomicOrdering::Monotonic);
+  builder->CreateFence(llvm::AtomicOrdering::Acquire);
+  same = builder->CreateAnd(
+      same, builder->CreateICmpEQ(
+                load(seq_ptr, llvm::AtomicOrdering::Monotonic), seq));
+  builder->CreateCondBr(same, hit_bb, miss_bb);
+
+  builder->SetInsertPoint(hit_bb);
+  count(stats ? &stats->hits : nullptr);
+  builder->CreateRet(builder->CreateBitCast(cached, dbl));
+
+  builder->SetInsertPoint(miss_bb);
+  count(stats ? &stats->misses : nullptr);
+  llvm::SmallVector<llvm::Value *, 8> args;
+  for (auto &arg : f->args())
+    args.push_back(&arg);
+  auto result = builder->CreateCall(impl, args, "result");
+  // a thread that finds the entry being written leaves it alone
+  auto old_seq = load(seq_ptr, llvm::AtomicOrdering::Monotonic);
+  builder->CreateCondBr(
+      builder->CreateICmpEQ(builder->CreateAnd(old_seq, 1),
+                            builder->getInt64(0)),
+      claim_bb, done_bb);
+
+  builder->SetInsertPoint(claim_bb);
+  auto claimed = builder->CreateAtomicCmpXchg(
+      seq_ptr, old_seq, builder->CreateAdd(old_seq, builder->getInt64(1)),
+      llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic,
+      llvm::AtomicOrdering::Monotonic);
+  builder->CreateCondBr(builder->CreateExtractValue(claimed, 1), fill_bb,
+                        done_bb);
+
+  builder->SetInsertPoint(fill_bb);
+  builder->CreateFence(llvm::AtomicOrdering::Release);
+  for (unsigned i = 0; i < n; i++)
+    store(keys[i], builder->CreateConstInBoundsGEP2_32(key_ty, key_array, 0, i),
+          llvm::AtomicOrdering::Monotonic);
+  store(builder->CreateBitCast(result, i64), result_ptr,
+        llvm::AtomicOrdering::Monotonic);
+  store(builder->CreateAdd(old_seq, builder->getInt64(2)), seq_ptr,
+        llvm::AtomicOrdering::Release);
+  builder->CreateBr(done_bb);
+
+  builder->SetInsertPoint(done_bb);
+  builder->CreateRet(result);
+
+  llvm::verifyFunction(*f);
+}
+
+void Codegen::mark_tail_calls(llvm::Function *f) {
+  std::vector<llvm::ReturnInst *> returns;
+  for (auto &bb : *f)
+    if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator()))
+      returns.push_back(ret);
+
+  // a block that does nothing but return (the phi of an if and a ret) is
+  // duplicated into the blocks that jump to it; for nested ifs the copies
+  // move up again
+  while (!returns.empty()) {
+    auto ret = returns.back();
+    returns.pop_back();
+    auto bb = ret->getParent();
+    auto phi = llvm::dyn_cast<llvm::PHINode>(ret->getReturnValue());
+    if (phi && phi->getParent() != bb)
+      phi = nullptr;
+    if (&bb->front() != (phi ? (llvm::Instruction *)phi : ret) ||
+        (phi && phi->getNextNode() != ret) || bb == &f->getEntryBlock())
+      continue;
+
+    llvm::SmallVector<llvm::BasicBlock *, 4> preds(llvm::predecessors(bb));
+    for (auto pred : preds) {
+      auto br = llvm::dyn_cast<llvm::BranchInst>(pred->getTerminator());
+      if (!br || br->isConditional())
+        continue;
+      auto value =
+          phi ? phi->getIncomingValueForBlock(pred) : ret->getReturnValue();
+      returns.push_back(llvm::ReturnInst::Create(*context, value, br));
+      br->eraseFromParent();
+      if (phi)
+        phi->removeIncomingValue(pred, false);
+    }
+
+    if (llvm::pred_empty(bb)) {
+      bb->dropAllReferences();
+      bb->eraseFromParent();
+    }
+  }
+
+  for (auto &bb : *f) {
+    auto ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator());
+    auto call =
+        ret ? llvm::dyn_cast_or_null<llvm::CallInst>(ret->getReturnValue())
+            : nullptr;
+    if (!call || call->getNextNode() != ret)
+      continue;
+    call->setTailCallKind(call->getFunctionType() == f->getFunctionType()
+                              ? llvm::CallInst::TCK_MustTail
+                              : llvm::CallInst::TCK_Tail);
+  }
+}
+
+bool Codegen::is_top_level(const llvm::Function *f) const {
+  auto name = f->getName();
+  return name.startswith("__anon_expr") || name.startswith("top_level.chunk") ||
+         name == top_level_name;
+}
+
+void Codegen::instrument(llvm::Function *f, unsigned id) {
+  if (is_top_level(f))
+    return;
+  auto &counters = profile->get(id);
+  auto i64 = builder->getInt64Ty();
+  auto counter = [&](void *c) {
+    return builder->CreateIntToPtr(builder->getInt64((uintptr_t)c),
+                                   i64->getPointerTo());
+  };
+  // other threads may be counting at once, or reading the counts
+  auto rmw = [&](llvm::AtomicRMWInst::BinOp op, std::atomic<uint64_t> &c,
+                 llvm::Value *n) {
+    return builder->CreateAtomicRMW(op, counter(&c), n, llvm::MaybeAlign(8),
+                                    llvm::AtomicOrdering::Monotonic);
+  };
+  auto add = [&](std::atomic<uint64_t> &c, llvm::Value *n) {
+    return rmw(llvm::AtomicRMWInst::Add, c, n);
+  };
+
+  auto &entry = f->getEntryBlock();
+  builder->SetInsertPoint(&entry, entry.getFirstInsertionPt());
+  add(counters.calls, builder->getInt64(1));
+  if (!profile->counts_cycles())
+    return;
+
+  // only the outermost activation adds its cycles, the recursive calls
+  // within are part of them already
+  auto read_cycles = llvm::Intrinsic::getDeclaration(
+      module.get(), llvm::Intrinsic::readcyclecounter);
+  auto depth = add(counters.depth, builder->getInt64(1));
+  depth->setName("depth");
+  auto start = builder->CreateCall(read_cycles, {}, "start");
+
+  for (auto &bb : *f) {
+    auto ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator());
+    if (!ret)
+      continue;
+    builder->SetInsertPoint(ret);
+    auto elapsed =
+        builder->CreateSub(builder->CreateCall(read_cycles, {}), start);
+    rmw(llvm::AtomicRMWInst::Sub, counters.depth, builder->getInt64(1));
+    add(counters.cycles,
+        builder->CreateSelect(
+            builder->CreateICmpEQ(depth, builder->getInt64(0)), elapsed,
+            builder->getInt64(0)));
+  }
+}
+
+std::string Codegen::tier_alias(unsigned id, int tier) const {
+  return (functions.get(id).name.str() + ".tier" + llvm::Twine(tier)).str();
+}
+
+Codegen::Tier &Codegen::make_tier(const ast::FunctionAST *node, unsigned id) {
+  // the AST of the definition before goes away once this one is defined
+  if (id < current_tier.size() && current_tier[id] >= 0)
+    tiers[current_tier[id]].def = nullptr;
+
+  tiers.emplace_back();
+  auto &tier = tiers.back();
+  tier.codegen = this;
+  tier.id = id;
+  tier.def = node;
+  tier.name = (functions.get(id).name.str() + ".hot" +
+               llvm::Twine(tiers.size() - 1))
+                  .str();
+  llvm::sort(tier_callees);
+  tier_callees.erase(std::unique(tier_callees.begin(), tier_callees.end()),
+                     tier_callees.end());
+  tier.callee_tiers = tier_callees;
+
+  // callers of the optimized version bind to this definition by the alias
+  if (id >= current_tier.size())
+    current_tier.resize(id + 1, -1);
+  current_tier[id] = tiers.size() - 1;
+  llvm::GlobalAlias::create(tier_alias(id, current_tier[id]),
+                            module_functions[id]);
+  return tier;
+}
+
+llvm::orc::ThreadSafeModule Codegen::build_tier(const Tier &tier) {
+  if (!tier.def)
+    return llvm::orc::ThreadSafeModule();
+
+  // whatever is pending is set aside, since the new module gets a context
+  // of its own; no function is being generated while JIT'd code runs
+  auto pending_context = std::move(ts_context);
+  auto pending_builder = std::move(builder);
+  auto pending = std::move(module);
+  auto pending_functions = std::move(module_functions);
+  auto pending_chunks = std::move(top_level_chunks);
+  auto pending_end = top_level_end;
+  init_module();
+
+  llvm::orc::ThreadSafeModule hot;
+  building = &tier;
+  if (llvm::Function *f = tier.def->accept(this)) {
+    // bodies of what it calls, for the inliner
+    link_callee_bodies();
+    f->setName(tier.name);
+    set_opt_level(*module, opt_level);
+    hot = llvm::orc::ThreadSafeModule(std::move(module), ts_context);
+  }
+  building = nullptr;
+
+  module.reset();
+  builder.reset();
+  ts_context = std::move(pending_context);
+  context = ts_context.getContext();
+  builder = std::move(pending_builder);
+  module = std::move(pending);
+  module_functions = std::move(pending_functions);
+  top_level_chunks = std::move(pending_chunks);
+  top_level_end = pending_end;
+  return hot;
+}
+
+void Codegen::add_tier_check(llvm::Function *f, Tier &tier) {
+  auto i64 = builder->getInt64Ty();
+  auto body = &f->getEntryBlock();
+  auto check_bb = llvm::BasicBlock::Create(*context, "tier.check", f, body);
+  auto hot_bb = llvm::BasicBlock::Create(*context, "tier.hot", f, body);
+  auto count_bb = llvm::BasicBlock::Create(*context, "tier.count", f, body);
+  auto up_bb = llvm::BasicBlock::Create(*context, "tier.up", f, body);
+  auto address = [&](void *p) {
+    return builder->getInt64((uint64_t)(uintptr_t)p);
+  };
+
+  // the stack slots stay in the entry block
+  for (auto it = body->begin(); it != body->end();)
+    if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*it++))
+      alloca->moveBefore(*check_bb, check_bb->end());
+
+  // optimized code, once there is some, runs in place of this
+  builder->SetInsertPoint(check_bb);
+  auto hot = builder->CreateAlignedLoad(
+      f->getType(),
+      builder->CreateIntToPtr(address(&tier.hot),
+                              f->getType()->getPointerTo()),
+      llvm::Align(8), "hot");
+  hot->setAtomic(llvm::AtomicOrdering::Acquire);
+  builder->CreateCondBr(builder->CreateIsNull(hot), count_bb, hot_bb);
+
+  builder->SetInsertPoint(hot_bb);
+  llvm::SmallVector<llvm::Value *, 8> args;
+  for (auto &arg : f->args())
+    args.push_back(&arg);
+  auto call = builder->CreateCall(f->getFunctionType(), hot, args);
+  call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+  builder->CreateRet(call);
+
+  // exactly one call, on whichever thread, sees the count reach the
+  // threshold
+  builder->SetInsertPoint(count_bb);
+  auto calls_ptr = builder->CreateIntToPtr(address(&tier.calls),
+                                           i64->getPointerTo());
+  auto calls = builder->CreateAdd(
+      builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, calls_ptr,
+                               builder->getInt64(1), llvm::MaybeAlign(8),
+                               llvm::AtomicOrdering::Monotonic),
+      builder->getInt64(1), "calls");
+  builder->CreateCondBr(
+      builder->CreateICmpEQ(calls, builder->getInt64(hot_threshold)), up_bb,
+      body, llvm::MDBuilder(*context).createBranchWeights(1, 1 << 20));
+
+  builder->SetInsertPoint(up_bb);
+  auto tier_up_ty = llvm::FunctionType::get(builder->getVoidTy(), {i64}, false);
+  builder->CreateCall(
+      tier_up_ty,
+      builder->CreateIntToPtr(address((void *)&Codegen::tier_up),
+                              tier_up_ty->getPointerTo()),
+      {address(&tier)});
+  builder->CreateBr(body);
+
+  llvm::verifyFunction(*f);
+}
+
+void Codegen::tier_up(Tier *tier) {
+  if (tier->requested.exchange(true))
+    return;
+  auto &codegen = *tier->codegen;
+  // a definition replaced since stays in the first tier
+  auto hot = codegen.build_tier(*tier);
+  if (!hot)
+    return;
+  auto &JIT = *codegen.JIT;
+  auto key = JIT.addPrivateModule(std::move(hot));
+  JIT.lookupAsync(key, tier->name,
+                  [tier](llvm::Expected<llvm::JITTargetAddress> addr) {
+                    if (!addr) {
+                      // the first tier keeps running
+                      llvm::logAllUnhandledErrors(addr.takeError(),
+                                                  llvm::errs(), "Error: ");
+                      return;
+                    }
+                    tier->hot.store((void *)(uintptr_t)*addr,
+                                    std::memory_order_release);
+                  });
+}
+
+void Codegen::apply_profile(llvm::Function *f) {
+  auto calls = profile->recorded_calls(f->getName());
+  if (!calls)
+    return;
+  f->setEntryCount(*calls);
+  if (*calls == 0)
+    f->addFnAttr(llvm::Attribute::Cold);
+}
+
+void Codegen::print_memo_stats() {
+  for (unsigned id = 0; id < memo_counters.size(); id++) {
+    if (!memo_counters[id])
+      continue;
+    auto &stats = *memo_counters[id];
+    uint64_t calls = stats.hits + stats.misses;
+    llvm::errs() << "memo " << functions.get(id).name.str() << ": "
+                 << stats.hits << " hits, " << stats.misses << " misses";
+    if (calls)
+      llvm::errs() << " (" << (100 * stats.hits / calls) << "% hit rate)";
+    llvm::errs() << "\n";
+  }
+}
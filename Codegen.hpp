@@ -1,68 +1,389 @@
 #ifndef CODEGEN_HPP
 #define CODEGEN_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <iostream>
-#include <map>
+#include <vector>
 #include <utility>
 
-#include "llvm/IR/LegacyPassManager.h" // llvm::legacy::FunctionPassManager()
-#include "llvm/Transforms/InstCombine/InstCombine.h" // llvm::createInstructionCombiningPass()
-#include "llvm/Transforms/Scalar.h" // llvm::createReassociatePass()
-                                    // llvm::createNewGVNPass()
-                                    // llvm::createCFGSimplificationPass()
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Target/TargetMachine.h"
 
 #include "AST.hpp"
+#include "FunctionTable.hpp"
 #include "KaleidoscopeJIT.h"
+#include "Options.hpp"
+#include "Profile.hpp"
+#include "Stats.hpp"
 #include "Visitor.hpp"
 
 class Codegen : public NodeVisitor {
-  llvm::LLVMContext context;
-  llvm::IRBuilder<> builder;
+  // every module gets a context of its own, so that the JIT can compile
+  // modules on several threads at once
+  llvm::orc::ThreadSafeContext ts_context;
+  llvm::LLVMContext *context;
+  std::unique_ptr<llvm::IRBuilder<>> builder;
   std::unique_ptr<llvm::Module> module;
-  std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
-  std::unique_ptr<llvm::legacy::FunctionPassManager> FPM;
-  std::map<std::string, llvm::Value *> named_values;
-  std::map<std::string, std::unique_ptr<ast::PrototypeAST>> function_protos;
+
+  // tiered JIT: one per definition. Its first-tier code counts its calls
+  // here and calls tier_up() once it is hot, which generates the optimized
+  // version from the definition's AST; from then on the first tier jumps to
+  // hot as soon as that is set. Declared before the JIT, whose compile
+  // threads set hot.
+  struct Tier {
+    Codegen *codegen;
+    unsigned id;
+    // null once the function is redefined, and its AST goes away
+    const ast::FunctionAST *def;
+    std::string name; // of the optimized version
+    // the tiers of the callees when the definition was generated, which the
+    // optimized version calls as well
+    std::vector<std::pair<unsigned, int>> callee_tiers;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<bool> requested{false};
+    std::atomic<void *> hot{nullptr};
+  };
+  std::deque<Tier> tiers;
+  std::vector<int> current_tier; // of the latest definition by function id
+  // the callees of the function being generated, with their current tiers
+  std::vector<std::pair<unsigned, int>> tier_callees;
+
+  std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT; // null ahead of time
+  std::unique_ptr<llvm::TargetMachine> TM;         // ahead of time only
+
+  // -O level; the JIT optimizes modules as they are compiled, ahead of time
+  // the whole module is optimized before it is emitted
+  unsigned opt_level;
+
+  // floating-point model: the builder's fast-math flags, every function's
+  // attributes and the target options follow it
+  ast::Options::FPModel fp_model;
+
+  // copy the bodies of called functions into every module, so the
+  // optimizer can inline across definitions
+  bool whole_program;
+
+  // start every function without optimizing it, see Tier
+  bool tiered_jit;
+  unsigned hot_threshold;
+
+  // the tier whose optimized version is being generated, null if none
+  const Tier *building = nullptr;
+
+  // stack slots of the arguments, loop and var variables of the function
+  // being generated, indexed by slot; the optimizer promotes them to
+  // registers
+  std::vector<llvm::AllocaInst *> named_values;
+
+  // every declared function, indexed by function id
+  ast::FunctionTable &functions;
+
+  // functions declared in the current module, indexed by function id
+  std::vector<llvm::Function *> module_functions;
+
+  // id of the function being generated, and whether everything its body
+  // calls so far is pure
+  unsigned cur_function = ~0u;
+  bool body_pure = true;
+
+  // functions to memoize, by name, and the entries in each one's table
+  llvm::StringSet<> memoized;
+  unsigned memo_size;
+
+  // memo hits and misses by function id, counted by the JIT'd code itself
+  // when statistics are on
+  struct MemoStats {
+    std::atomic<uint64_t> hits{0}, misses{0};
+  };
+  bool memo_stats;
+  std::vector<std::unique_ptr<MemoStats>> memo_counters;
+
+  // set while bodies are copied in by link_callee_bodies()
+  bool linking = false;
+
+  // null unless statistics are on
+  Stats *stats;
+
+  // counters every function updates, and counts from an earlier run; null
+  // unless profiling
+  Profile *profile;
+
+  // concurrent mode: the current entry point of every defined function, by
+  // id, null until one is published. Every call loads it from here, so
+  // publish() redirects them atomically; a deque, since JIT'd code holds
+  // slot addresses. The Resolver keeps a defined function from changing its
+  // arity.
+  bool concurrent;
+  std::deque<std::atomic<void *>> slots;
+
+public:
+  // f over a batch: results[i] = f(columns[0][i], columns[1][i], ...) for
+  // every i < rows, one column per argument
+  using BatchFunction = void (*)(const double *const *columns,
+                                 double *results, uint64_t rows);
+
+private:
+  // batch wrappers by function id, for the definition they were made for,
+  // and the module each one is in
+  struct BatchEntry {
+    unsigned version = 0;
+    BatchFunction addr = nullptr;
+    llvm::orc::KaleidoscopeJIT::ModuleKey key = nullptr;
+  };
+  std::vector<BatchEntry> batch_functions;
+
+  // with a single module, top-level expressions are generated one block
+  // each into chunk functions that run them in source order and print their
+  // values; the top-level function calls the chunks, ahead of time it is
+  // main(). Chunks are kept small since the backend slows down more than
+  // linearly on huge functions.
+  static constexpr unsigned top_level_chunk = 128;
+  const char *top_level_name;
+  std::vector<llvm::Function *> top_level_chunks;
+  llvm::BasicBlock *top_level_end = nullptr; // of the last chunk
+  unsigned top_level_count = 0;              // in the last chunk
 
 public:
-  Codegen()
-      : builder(context), JIT(std::make_unique<llvm::orc::KaleidoscopeJIT>()) {
-    init_module_and_pass_mngr();
+  explicit Codegen(ast::FunctionTable &functions,
+                   const ast::Options &options = ast::Options(),
+                   Stats *stats = nullptr, Profile *profile = nullptr)
+      : context(nullptr), opt_level(options.opt_level),
+        fp_model(options.fp_model),
+        whole_program(options.whole_program && !options.tiered &&
+                      !options.concurrent && !options.tiered_jit),
+        tiered_jit(options.tiered_jit && !options.aot() && !options.tiered &&
+                   !options.concurrent),
+        hot_threshold(std::max(options.hot_threshold, 1u)),
+        functions(functions), memo_size(llvm::PowerOf2Ceil(
+                                  std::max(options.memo_size, 1u))),
+        memo_stats(options.memo_stats && !options.aot()), stats(stats),
+        profile(profile), concurrent(options.concurrent),
+        top_level_name(options.aot() ? "main" : "__top_level") {
+    if (options.aot())
+      TM = create_host_target_machine(opt_level, fp_model, options.cpu,
+                                      options.cpu_features);
+    else
+      // a lazy stub would compile on the calling thread; with tiers, code
+      // starts out unoptimized, and optimized versions are compiled on a
+      // thread of their own
+      JIT = std::make_unique<llvm::orc::KaleidoscopeJIT>(
+          options.lazy && !concurrent && !tiered_jit,
+          tiered_jit ? std::max(options.compile_threads, 1u)
+                     : options.compile_threads,
+          options.cache_dir, tiered_jit ? 0 : opt_level,
+          options.function_passes_only && !tiered_jit, stats, fp_model,
+          options.cpu, options.cpu_features);
+    if (!concurrent)
+      memoized.insert(options.memoize.begin(), options.memoize.end());
+    init_module();
   }
 
   // NumberExprAST
-  llvm::Value *visit(ast::NumberExprAST *node) override;
+  llvm::Value *visit(const ast::NumberExprAST *node) override;
 
   // VariableExprAST
-  llvm::Value *visit(ast::VariableExprAST *node) override;
+  llvm::Value *visit(const ast::VariableExprAST *node) override;
 
   // BinaryExprAST
-  llvm::Value *visit(ast::BinaryExprAST *node) override;
+  llvm::Value *visit(const ast::BinaryExprAST *node) override;
 
   // CallExprAST
-  llvm::Value *visit(ast::CallExprAST *node) override;
+  llvm::Value *visit(const ast::CallExprAST *node) override;
+
+  // IfExprAST
+  llvm::Value *visit(const ast::IfExprAST *node) override;
+
+  // ForExprAST
+  llvm::Value *visit(const ast::ForExprAST *node) override;
+
+  // VarExprAST
+  llvm::Value *visit(const ast::VarExprAST *node) override;
+
+  // AssignExprAST
+  llvm::Value *visit(const ast::AssignExprAST *node) override;
 
   // PrototypeAST
-  llvm::Function *visit(ast::PrototypeAST *node) override;
+  llvm::Function *visit(const ast::PrototypeAST *node) override;
 
   // FunctionAST
-  llvm::Function *visit(ast::FunctionAST *node) override;
+  llvm::Function *visit(const ast::FunctionAST *node) override;
+
+  // generates node, a new definition, after setting aside the bodies of
+  // dependents, the functions that call it, that are in the current module,
+  // so that it calls the ones regenerate() makes; null if node failed, then
+  // they are put back
+  llvm::Function *generate(const ast::FunctionAST *node,
+                           llvm::ArrayRef<unsigned> dependents);
+
+  // generates the definitions of dependents again into the current module,
+  // so that they call the newest definitions, each other's included; once
+  // the function table has node, for the bodies linked in for the inliner
+  void regenerate(llvm::ArrayRef<unsigned> dependents);
 
   // Dumping generated IR
   void dump() { module->print(llvm::errs(), nullptr); }
-  
-  void add_module();
 
-  void store_proto(const std::string& name, std::unique_ptr<ast::PrototypeAST> ptr);
+  // prints f the way the JIT is going to compile it: a copy of the current
+  // module goes through the passes the module will get when it is added
+  void print_optimized(const llvm::Function *f);
   
+  // hands the current module to the JIT, see take_module()
+  llvm::orc::KaleidoscopeJIT::ModuleKey add_module();
+
+  // frees the machine code of a module added by add_module()
+  void remove_module(llvm::orc::KaleidoscopeJIT::ModuleKey key);
+
   // JIT evaluate
   void eval();
 
+  // JITs a defined function, together with every function it reaches that
+  // has no native code yet; returns its entry point, null on error
+  void *compile_function(unsigned id);
+
+  // makes sure every function in ids has native code
+  bool compile_callees(llvm::ArrayRef<unsigned> ids);
+
+  // JITs (once per definition) a loop that maps the defined function id over
+  // arrays of arguments, with an inlined copy of its body so that LLVM can
+  // vectorize the loop for the host. The wrapper is a module of its own,
+  // definitions pending in the current module are added to the JIT first;
+  // null if id isn't defined, in concurrent mode, or on error
+  BatchFunction get_batch_function(unsigned id);
+
+  // frees the batch wrapper of id, if it has one; it calls into the module
+  // of the definition, so it goes when that module does
+  void free_batch_function(unsigned id);
+
+  // native address of a function, looked up in the JIT and then in the host
+  // process (for externs); null if it's in neither, and after reporting the
+  // error if the JIT failed to materialize it
+  void *get_address(unsigned id);
+
+  // concurrent mode: points the slot of id at its newest definition, so
+  // every call that starts from now on goes there; false if it has no code
+  bool publish(unsigned id);
+
+  // concurrent mode: the slot of id, null until it has been published
+  const std::atomic<void *> *get_slot(unsigned id) const;
+
   // Initializing module
-  void init_module_and_pass_mngr(void);
+  void init_module(void);
+
+  // object cache statistics, if there is a cache
+  void print_cache_stats();
+
+  // hit rate of every memoized function, if statistics are on
+  void print_memo_stats();
+
+  // with a single module: appends a top-level expression to the top-level
+  // function; false if its codegen failed, then nothing is added
+  bool add_top_level(const ast::FunctionAST *node);
+
+  // whether add_top_level() added anything since the top-level function
+  // last ran
+  bool has_top_level() const { return !top_level_chunks.empty(); }
+
+  // JITs the current module and runs the top-level function
+  void eval_top_level();
+
+  // ahead of time: finishes main(), optimizes the whole module and writes it to
+  // path as a native object; with internalize, nothing but main() stays
+  // visible, which lets the optimizer inline and drop the rest freely
+  bool emit_object(const std::string &path, bool internalize);
 
 private:
-  llvm::Function *get_func(const std::string &name);
+  llvm::Function *get_func(unsigned id);
+
+  // a redefinition within the same module: the body of id already in it, if
+  // any, stays behind under a private name, so code generated before keeps
+  // calling the definition it saw. Returns it, null if there was none.
+  llvm::Function *set_aside(unsigned id);
+
+  // puts old back as the definition of id, after the one that replaced it
+  // failed and left f, its declaration or nothing
+  void restore(unsigned id, llvm::Function *old);
+
+  // a double, or a value of type, on the stack of f, allocated in its entry
+  // block where mem2reg and SROA look for them
+  llvm::AllocaInst *create_entry_alloca(llvm::Function *f, llvm::StringRef name,
+                                        llvm::Type *type = nullptr);
+
+  // the slot of id, created if it's new
+  std::atomic<void *> &slot(unsigned id);
+
+  // moves the body of f to an internal function and puts a lookup in a
+  // direct-mapped table of memo_size entries in front of it; a colliding
+  // call evicts the entry. Recursive calls go through the table too. Each
+  // entry is guarded by a sequence number, so threads calling f at once
+  // never see half of another's entry.
+  void memoize(llvm::Function *f, unsigned id);
+
+  // moves every return that follows a join up into the blocks that branch
+  // to it, then marks each call whose value is returned right away: musttail
+  // if the callee has f's type, so it is a jump at any optimization level,
+  // tail otherwise
+  void mark_tail_calls(llvm::Function *f);
+
+  // true for the functions that run top-level expressions: the REPL's
+  // anonymous ones, and the chunks and entry point of a single module
+  bool is_top_level(const llvm::Function *f) const;
+
+  // counts every call to f in the profile, and the cycles until it returns
+  // if the profile counts those; top-level functions are left alone
+  void instrument(llvm::Function *f, unsigned id);
+
+  // tiered JIT: a new Tier for the definition f was just generated from;
+  // the one of the definition before is retired
+  Tier &make_tier(const ast::FunctionAST *node, unsigned id);
+
+  // tiered JIT: generates the optimized version of tier into a module and
+  // context of its own, leaving whatever is pending alone; its calls bind to
+  // the same definitions as the first tier's. Empty if the definition was
+  // replaced since.
+  llvm::orc::ThreadSafeModule build_tier(const Tier &tier);
+
+  // tiered JIT: puts the check for optimized code and the call counter in
+  // front of the first-tier code f
+  void add_tier_check(llvm::Function *f, Tier &tier);
+
+  // tiered JIT: called by first-tier code once it is hot; generates the
+  // optimized version and starts compiling it. Only the REPL tiers (see
+  // Session), so this runs on the thread that runs the compiler, while it
+  // waits for JIT'd code to return.
+  static void tier_up(Tier *tier);
+
+  // tiered JIT: the name that refers to the first-tier code of id's
+  // definition with the given tier and no later one
+  std::string tier_alias(unsigned id, int tier) const;
+
+  // attaches the calls to f in the loaded profile as its entry count, and
+  // marks f cold if it was never called
+  void apply_profile(llvm::Function *f);
+
+  static std::unique_ptr<llvm::TargetMachine>
+  create_host_target_machine(unsigned opt_level, ast::Options::FPModel fp_model,
+                             const std::string &cpu,
+                             llvm::ArrayRef<std::string> cpu_features);
+
+  // hands the current module over for the JIT, with the bodies of called
+  // functions linked in first in whole-program mode
+  llvm::orc::ThreadSafeModule take_module();
+
+  // gives every called function that is defined elsewhere an
+  // available_externally copy of its body: the optimizer may inline it, but
+  // calls that stay still go to the real definition
+  void link_callee_bodies();
+
+  // closes the last chunk, and adds and returns the top-level function
+  llvm::Function *finish_top_level();
+
+  // returns from the last chunk and verifies it
+  void finish_top_level_chunk();
 };
 
 #endif // CODEGEN_HPP
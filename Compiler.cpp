@@ -1,9 +1,16 @@
 #include <cctype>
+#include <cstdio>
 #include <iostream>
 
 #include "Compiler.hpp"
 #include "Error.hpp"
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+
 namespace ast {
 
 int Compiler::get_tok_precedence() {
@@ -16,15 +23,33 @@ int Compiler::get_tok_precedence() {
   }
 }
 
-void Compiler::get_tok() { cur_token = lexer->get_tok(); }
+void Compiler::get_tok() {
+  // between items there are few tokens, they can have a timer each
+  if (!stats || !parse_timer) {
+    Stats::Timer timer(stats.get(), Stats::lex);
+    cur_token = lexer->get_tok();
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  cur_token = lexer->get_tok();
+  parse_timer->lexing += std::chrono::steady_clock::now() - start;
+  parse_timer->tokens++;
+}
 
-std::unique_ptr<ExprAST> Compiler::parse_number_expr() {
-  auto result = std::make_unique<NumberExprAST>(lexer->get_num_val());
+Compiler::ParseTimer::~ParseTimer() {
+  timer.share(
+      Stats::lex,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(lexing).count(),
+      tokens);
+  compiler.parse_timer = outer;
+}
+ExprAST *Compiler::parse_number_expr() {
+  auto result = arena->make<NumberExprAST>(lexer->get_num_val());
   get_tok();
-  return std::move(result);
+  return result;
 }
 
-std::unique_ptr<ExprAST> Compiler::parse_paren_expr() {
+ExprAST *Compiler::parse_paren_expr() {
   get_tok(); // eat '('
   auto expr = parse_expr();
   if (!expr)
@@ -37,20 +62,20 @@ std::unique_ptr<ExprAST> Compiler::parse_paren_expr() {
   return expr;
 }
 
-std::unique_ptr<ExprAST> Compiler::parse_ident_expr() {
-  std::string ident = lexer->get_identifier();
+ExprAST *Compiler::parse_ident_expr() {
+  Symbol ident = lexer->get_identifier();
   get_tok(); // get next token, eat identifier
 
   // variable reference
   if (cur_token != '(')
-    return std::make_unique<VariableExprAST>(ident);
+    return arena->make<VariableExprAST>(ident);
 
   // function call
   get_tok(); // eat '('
-  std::vector<std::unique_ptr<ExprAST>> args;
+  llvm::SmallVector<ExprAST *, 8> args;
   while (cur_token != ')') {
     if (auto arg = parse_expr())
-      args.push_back(std::move(arg));
+      args.push_back(arg);
     else
       return nullptr;
 
@@ -63,10 +88,110 @@ std::unique_ptr<ExprAST> Compiler::parse_ident_expr() {
   }
 
   get_tok(); // eat ')'
-  return std::make_unique<CallExprAST>(ident, std::move(args));
+  return arena->make<CallExprAST>(ident,
+                                 arena->copy(llvm::makeArrayRef(args)));
+}
+
+ExprAST *Compiler::parse_if_expr() {
+  get_tok(); // eat 'if'
+  auto cond = parse_expr();
+  if (!cond)
+    return nullptr;
+
+  if (cur_token != tok_then)
+    return log_error("expected 'then'");
+  get_tok(); // eat 'then'
+  auto then = parse_expr();
+  if (!then)
+    return nullptr;
+
+  if (cur_token != tok_else)
+    return log_error("expected 'else'");
+  get_tok(); // eat 'else'
+  auto els = parse_expr();
+  if (!els)
+    return nullptr;
+
+  return arena->make<IfExprAST>(cond, then, els);
+}
+
+ExprAST *Compiler::parse_for_expr() {
+  get_tok(); // eat 'for'
+  if (cur_token != tok_identifier)
+    return log_error("expected an identifier after 'for'");
+  Symbol var = lexer->get_identifier();
+  get_tok(); // eat identifier
+
+  if (cur_token != '=')
+    return log_error("expected '=' after the loop variable");
+  get_tok(); // eat '='
+  auto start = parse_expr();
+  if (!start)
+    return nullptr;
+
+  if (cur_token != ',')
+    return log_error("expected ',' after the start value");
+  get_tok(); // eat ','
+  auto end = parse_expr();
+  if (!end)
+    return nullptr;
+
+  // the step is optional
+  ExprAST *step = nullptr;
+  if (cur_token == ',') {
+    get_tok(); // eat ','
+    step = parse_expr();
+    if (!step)
+      return nullptr;
+  }
+
+  if (cur_token != tok_in)
+    return log_error("expected 'in' after the loop header");
+  get_tok(); // eat 'in'
+  auto body = parse_expr();
+  if (!body)
+    return nullptr;
+
+  return arena->make<ForExprAST>(var, start, end, step, body);
+}
+
+ExprAST *Compiler::parse_var_expr() {
+  get_tok(); // eat 'var'
+  llvm::SmallVector<Symbol, 4> names;
+  llvm::SmallVector<ExprAST *, 4> inits;
+  while (true) {
+    if (cur_token != tok_identifier)
+      return log_error("expected an identifier after 'var'");
+    names.push_back(lexer->get_identifier());
+    get_tok(); // eat identifier
+
+    // the initial value is optional
+    ExprAST *init = nullptr;
+    if (cur_token == '=') {
+      get_tok(); // eat '='
+      init = parse_expr();
+      if (!init)
+        return nullptr;
+    }
+    inits.push_back(init);
+
+    if (cur_token != ',')
+      break;
+    get_tok(); // eat ','
+  }
+
+  if (cur_token != tok_in)
+    return log_error("expected 'in' after the variables");
+  get_tok(); // eat 'in'
+  auto body = parse_expr();
+  if (!body)
+    return nullptr;
+
+  return arena->make<VarExprAST>(arena->copy(llvm::makeArrayRef(names)),
+                                 arena->copy(llvm::makeArrayRef(inits)), body);
 }
 
-std::unique_ptr<ExprAST> Compiler::parse_primary() {
+ExprAST *Compiler::parse_primary() {
   switch (cur_token) {
   case tok_identifier:
     return parse_ident_expr();
@@ -74,23 +199,31 @@ std::unique_ptr<ExprAST> Compiler::parse_primary() {
     return parse_number_expr();
   case '(':
     return parse_paren_expr();
+  case tok_if:
+    return parse_if_expr();
+  case tok_for:
+    return parse_for_expr();
+  case tok_var:
+    return parse_var_expr();
+  case tok_error:
+    // already reported by the lexer
+    return nullptr;
   default:
     return log_error("unknown token when expecting an expression");
   }
 }
 
-std::unique_ptr<ExprAST> Compiler::parse_expr() {
+ExprAST *Compiler::parse_expr() {
   // an expression is a primary expression followed by a sequence of [binop,
   // primary] pairs
   auto LHS = parse_primary();
   if (!LHS)
     return nullptr;
 
-  return parse_binop_rhs(0, std::move(LHS));
+  return parse_binop_rhs(0, LHS);
 }
 
-std::unique_ptr<ExprAST>
-Compiler::parse_binop_rhs(int expr_prec, std::unique_ptr<ExprAST> LHS) {
+ExprAST *Compiler::parse_binop_rhs(int expr_prec, ExprAST *LHS) {
   while (true) {
     int tok_prec = get_tok_precedence();
 
@@ -108,31 +241,37 @@ Compiler::parse_binop_rhs(int expr_prec, std::unique_ptr<ExprAST> LHS) {
       return nullptr;
 
     // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
+    // the pending operator take RHS as its LHS. '=' is right associative, so
+    // a = b = c assigns c to both.
     int next_tok = get_tok_precedence();
-    if (tok_prec < next_tok) {
-      RHS = parse_binop_rhs(tok_prec + 1, std::move(RHS));
+    if (tok_prec < next_tok || (binop == '=' && tok_prec == next_tok)) {
+      RHS = parse_binop_rhs(binop == '=' ? tok_prec : tok_prec + 1, RHS);
       if (!RHS)
         return nullptr;
     }
 
-    LHS =
-        std::make_unique<BinaryExprAST>(binop, std::move(LHS), std::move(RHS));
+    if (binop == '=') {
+      auto var = llvm::dyn_cast<VariableExprAST>(LHS);
+      if (!var)
+        return log_error("destination of '=' must be a variable");
+      LHS = arena->make<AssignExprAST>(var, RHS);
+    } else
+      LHS = arena->make<BinaryExprAST>(binop, LHS, RHS);
   }
 }
 
-std::unique_ptr<PrototypeAST> Compiler::parse_prototype() {
+PrototypeAST *Compiler::parse_prototype() {
   if (cur_token != tok_identifier)
     return log_errorP("expecting an identifier but got invalid token");
 
-  std::string func_name = lexer->get_identifier();
+  Symbol func_name = lexer->get_identifier();
   get_tok();
 
   if (cur_token != '(')
     return log_errorP("expecting a '(' but got invalid token");
 
   get_tok(); // eat (
-  std::vector<std::string> args;
+  llvm::SmallVector<Symbol, 8> args;
   while (cur_token == tok_identifier) {
     args.push_back(lexer->get_identifier());
     get_tok();
@@ -142,101 +281,366 @@ std::unique_ptr<PrototypeAST> Compiler::parse_prototype() {
     return log_errorP("expecting a ')' but got invalid token");
 
   get_tok(); // eat )
-  return std::make_unique<PrototypeAST>(func_name, std::move(args));
+  return arena->make<PrototypeAST>(func_name,
+                                  arena->copy(llvm::makeArrayRef(args)));
 }
 
-std::unique_ptr<PrototypeAST> Compiler::parse_extern() {
+PrototypeAST *Compiler::parse_extern() {
+  ParseTimer timer(*this);
   get_tok(); // eat extern
   return parse_prototype();
 }
 
-std::unique_ptr<FunctionAST> Compiler::parse_definition() {
+FunctionAST *Compiler::parse_definition() {
+  ParseTimer timer(*this);
   get_tok(); // eat 'def'
   auto proto = parse_prototype();
   if (!proto)
     return nullptr;
 
   if (auto expr = parse_expr())
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+    return arena->make<FunctionAST>(proto, expr);
 
   return nullptr;
 }
 
-std::unique_ptr<FunctionAST> Compiler::parse_top_level() {
+FunctionAST *Compiler::parse_top_level() {
+  ParseTimer timer(*this);
   if (auto expr = parse_expr()) {
-    auto proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+    static const Symbol anon_expr = Symbol::intern("__anon_expr");
+    auto proto = arena->make<PrototypeAST>(anon_expr, llvm::ArrayRef<Symbol>());
+    return arena->make<FunctionAST>(proto, expr);
   }
   return nullptr;
 }
 
-void Compiler::handle_def(Codegen &codegen) {
+bool Compiler::resolve(FunctionAST *fn) {
+  Stats::Timer timer(stats.get(), Stats::resolve);
+  return resolver.resolve(fn);
+}
+
+bool Compiler::resolve(PrototypeAST *proto) {
+  Stats::Timer timer(stats.get(), Stats::resolve);
+  return resolver.resolve(proto);
+}
+
+void Compiler::fold(FunctionAST *fn) {
+  if (!options.fold)
+    return;
+  Stats::Timer timer(stats.get(), Stats::fold);
+  folder.fold(fn, *arena);
+}
+
+bool Compiler::interpret(const FunctionAST *fn, double &result) {
+  Stats::Timer timer(stats.get(), Stats::execute);
+  Interpreter interp(functions, *codegen, options.hot_threshold);
+  return interp.run(fn, result);
+}
+
+bool Compiler::handle_def() {
   if (auto def_ast = parse_definition()) {
-    if (auto def_ir = def_ast->accept(&codegen)) {
-      std::cout << "parsed a function definiton\n" << std::flush;
-      def_ir->print(llvm::errs());
-      //std::cout << std::endl;
-      codegen.add_module();
-      codegen.init_module_and_pass_mngr();
+    if (!resolve(def_ast)) {
+      // unknown names were reported by the resolver
+      arena->reset();
+      return false;
+    }
+    fold(def_ast);
+
+    // with rebinding, everything that calls the function is generated again
+    // along with it
+    std::vector<unsigned> dependents;
+    if (options.rebinds())
+      dependents = functions.dependents(def_ast->get_proto()->get_id());
+
+    if (options.tiered) {
+      // compiled once it gets hot, and so are the dependents, which go back
+      // to the interpreter
+      if (interactive())
+        std::cout << "parsed a function definiton\n" << std::flush;
+      // otherwise functions that call the old definition keep calling it,
+      // as JIT'd code does, so the ones still interpreted are compiled
+      // against it first
+      auto &info = functions.get(def_ast->get_proto()->get_id());
+      if (!options.rebinds() && info.def)
+        codegen->compile_callees(info.callers);
+      functions.define(def_ast, std::move(arena), resolver.get_callees());
+      arena = std::make_unique<Arena>();
+      for (unsigned id : dependents)
+        functions.rebind(id);
+      return true;
+    } else if (auto def_ir = codegen->generate(def_ast, dependents)) {
+      if (interactive())
+        std::cout << "parsed a function definiton\n" << std::flush;
+      // the body stays around for the interpreter and later passes
+      functions.define(def_ast, std::move(arena), resolver.get_callees());
+      arena = std::make_unique<Arena>();
+      for (unsigned id : dependents)
+        functions.rebind(id);
+      codegen->regenerate(dependents);
+
+      // in a single module it stays until the whole input has been read
+      if (!options.single_module()) {
+        if (interactive())
+          codegen->print_optimized(def_ir);
+        codegen->add_module();
+        codegen->init_module();
+      }
+      return true;
     }
   } else
     // Skip token for error recovery.
     get_tok();
+
+  // the whole tree goes away in one step
+  arena->reset();
+  return false;
 }
 
-void Compiler::handle_extern(Codegen &codegen) {
+bool Compiler::handle_extern() {
   if (auto ex_ast = parse_extern()) {
-    if (auto ex_ir = ex_ast->accept(&codegen)) {
-      std::cout << "parsed an extern\n" << std::flush;
-      ex_ir->print(llvm::errs());
-      //std::cout << std::endl;
-      codegen.store_proto(ex_ast->get_name(), std::move(ex_ast));
+    if (!resolve(ex_ast)) {
+      arena->reset();
+      return false;
+    }
+    if (auto ex_ir = ex_ast->accept(codegen.get())) {
+      if (interactive()) {
+        std::cout << "parsed an extern\n" << std::flush;
+        ex_ir->print(llvm::errs());
+      }
+      arena->reset();
+      return true;
     }
   } else
     // Skip token for error recovery.
     get_tok();
+
+  arena->reset();
+  return false;
 }
 
-void Compiler::handle_top_level(Codegen &codegen) {
+void Compiler::handle_top_level() {
   if (auto fn_ast = parse_top_level()) {
-    if (auto fn_ir = fn_ast->accept(&codegen)) {
-      //std::cout << "parsed a top-level expression\n" << std::flush;
-      //fn_ir->print(llvm::errs());
-      //std::cout << std::endl;
-      
+    double result;
+    if (!resolve(fn_ast)) {
+      // unknown names were reported by the resolver
+      arena->reset();
+      return;
+    }
+    fold(fn_ast);
+
+    auto folded = llvm::dyn_cast<NumberExprAST>(fn_ast->get_body());
+    if (folded && !options.single_module()) {
+      // known at compile time, no need for the JIT
+      std::cout << "Evaluated to: " << folded->get_val() << "\n";
+    } else if (options.tiered && interpret(fn_ast, result)) {
+      std::cout << "Evaluated to: " << result << "\n";
+    } else if (options.tiered && !codegen->compile_callees(resolver.get_callees())) {
+      // errors were reported by codegen
+    } else if (options.single_module()) {
+      // run once the input ends, or by main() in the emitted program
+      codegen->add_top_level(fn_ast);
+    } else if (fn_ast->accept(codegen.get())) {
       // only evaluate on top-level expressions
-      codegen.eval();
+      codegen->eval();
     }
   } else
     // Skip token for error recovery.
     get_tok();
+
+  arena->reset();
+}
+
+// links obj into an executable with the system C compiler driver, which
+// knows where the C runtime and libm live on this host
+static bool link_executable(llvm::StringRef obj, llvm::StringRef exe) {
+  auto cc = llvm::sys::findProgramByName("cc");
+  if (!cc) {
+    std::cerr << "Error: cannot find cc to link " << exe.str() << std::endl;
+    return false;
+  }
+
+  llvm::StringRef args[] = {*cc, obj, "-o", exe, "-lm"};
+  std::string err;
+  if (llvm::sys::ExecuteAndWait(*cc, args, llvm::None, {}, 0, 0, &err)) {
+    std::cerr << "Error: linking " << exe.str() << " failed";
+    if (!err.empty())
+      std::cerr << ": " << err;
+    std::cerr << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void Compiler::print_stats(llvm::raw_ostream &out) const {
+  if (!stats)
+    return;
+  if (options.stats == Options::stats_json)
+    stats->print_json(out);
+  else
+    stats->print(out);
+}
+
+bool Compiler::emit() {
+  if (options.emit == Options::emit_obj)
+    return codegen->emit_object(options.output, false);
+
+  llvm::SmallString<128> obj;
+  if (auto err = llvm::sys::fs::createTemporaryFile("kc", "o", obj)) {
+    std::cerr << "Error: cannot create a temporary object: " << err.message()
+              << std::endl;
+    return false;
+  }
+  bool ok = codegen->emit_object(obj.str().str(), true) &&
+            link_executable(obj, options.output);
+  llvm::sys::fs::remove(obj);
+  return ok;
 }
 
-void Compiler::compile() {
-  std::cout << "ready> " << std::flush;
-  Codegen codegen;
+void Compiler::run_top_level() {
+  if (cerr_buf) {
+    std::cerr.rdbuf(cerr_buf);
+    cerr_buf = nullptr;
+  }
+  codegen->eval_top_level();
+  std::fflush(stdout);
+  std::cerr << held_errors.str();
+  held_errors.str("");
+}
+
+bool Compiler::compile() {
+  if (interactive())
+    std::cout << "ready> " << std::flush;
   get_tok();
 
+  // in batch mode, a run of top-level expressions goes into one module and
+  // runs once the run ends
+  bool batch = options.single_module() && !options.aot();
+
   while (true) {
+    if (batch && codegen->has_top_level()) {
+      if (cur_token == tok_eof || cur_token == tok_def ||
+          cur_token == tok_extern || held_errors.tellp() > 0)
+        run_top_level();
+      else if (!cerr_buf)
+        cerr_buf = std::cerr.rdbuf(held_errors.rdbuf());
+    }
+
     switch (cur_token) {
-    case tok_eof:
-      return;
+    case tok_eof: {
+      bool ok = true;
+      // a name can only be checked once every definition has been seen
+      for (auto &name : options.memoize) {
+        int id = functions.lookup(Symbol::intern(name));
+        if (id < 0 || !functions.get(id).def) {
+          std::cerr << "Error: --memoize names " << name
+                    << ", which is never defined" << std::endl;
+          ok = false;
+        }
+      }
+      if (options.aot())
+        ok &= emit();
+      if (options.cache_stats)
+        codegen->print_cache_stats();
+      if (options.memo_stats)
+        codegen->print_memo_stats();
+      if (stats)
+        print_stats(llvm::errs());
+      if (profile && profile->counts_calls()) {
+        profile->print(llvm::errs());
+        if (!options.profile_output.empty())
+          ok &= profile->save(options.profile_output);
+      }
+      return ok;
+    }
     case ';': // ignore top-level semicolons.
       get_tok();
       break;
     case tok_def:
-      handle_def(codegen);
+      handle_def();
       break;
     case tok_extern:
-      handle_extern(codegen);
+      handle_extern();
       break;
     default:
-      handle_top_level(codegen);
+      handle_top_level();
+      break;
+    }
+    if (interactive())
+      std::cout << "ready> " << std::flush;
+  }
+}
+
+bool Compiler::add_source(std::unique_ptr<llvm::MemoryBuffer> source,
+                          llvm::orc::KaleidoscopeJIT::ModuleKey &module,
+                          std::vector<unsigned> &defined) {
+  unsigned first_version = functions.last_version() + 1;
+  lexer = std::make_unique<Lexer>(std::move(source));
+  bool ok = true;
+  get_tok();
+
+  while (cur_token != tok_eof) {
+    switch (cur_token) {
+    case ';':
+      get_tok();
+      break;
+    case tok_def:
+      ok &= handle_def();
+      break;
+    case tok_extern:
+      ok &= handle_extern();
+      break;
+    default:
+      // nothing runs until the caller asks for a function
+      if (parse_top_level())
+        log_error("top-level expressions cannot be run in a library session");
+      else
+        // Skip token for error recovery.
+        get_tok();
+      arena->reset();
+      ok = false;
       break;
     }
-    std::cout << "ready> " << std::flush;
   }
 
-  codegen.dump();
+  module = codegen->add_module();
+  codegen->init_module();
+  for (unsigned id = 0; id < functions.size(); id++)
+    if (functions.get(id).version >= first_version)
+      defined.push_back(id);
+  return ok;
+}
+
+unsigned Compiler::parse_source(std::unique_ptr<llvm::MemoryBuffer> source,
+                                llvm::function_ref<void(FunctionAST *)> parsed) {
+  lexer = std::make_unique<Lexer>(std::move(source));
+  unsigned items = 0;
+  get_tok();
+
+  while (cur_token != tok_eof) {
+    if (cur_token == ';') {
+      get_tok();
+      continue;
+    }
+
+    FunctionAST *fn = nullptr;
+    bool ok;
+    if (cur_token == tok_def)
+      ok = (fn = parse_definition());
+    else if (cur_token == tok_extern)
+      ok = parse_extern();
+    else
+      ok = (fn = parse_top_level());
+
+    if (!ok)
+      // Skip token for error recovery.
+      get_tok();
+    else {
+      items++;
+      if (fn)
+        parsed(fn);
+    }
+    arena->reset();
+  }
+  return items;
 }
 } // namespace ast
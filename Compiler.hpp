@@ -1,41 +1,154 @@
 #ifndef COMPILER_HPP
 #define COMPILER_HPP
 
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 
 #include "AST.hpp"
+#include "Arena.hpp"
 #include "Codegen.hpp"
+#include "Folder.hpp"
+#include "FunctionTable.hpp"
+#include "Interpreter.hpp"
 #include "Lexer.hpp"
 #include "KaleidoscopeJIT.h"
+#include "Options.hpp"
+#include "Profile.hpp"
+#include "Resolver.hpp"
+#include "Stats.hpp"
 
 namespace ast {
 class Compiler {
-  std::unordered_map<char, int> precedence;
   std::unique_ptr<Lexer> lexer;
-  std::istream &input;
   int cur_token;
 
+  // owns the nodes of the item being parsed, reset once codegen is done;
+  // definitions hand their arena over to the function table instead
+  std::unique_ptr<Arena> arena;
+
+  // every function declared so far, by id
+  FunctionTable functions;
+  Resolver resolver;
+  Folder folder;
+
+  Options options;
+  std::unordered_map<char, int> precedence;
+
+  // batch mode: errors reported while top-level expressions are waiting to
+  // run, printed once they have
+  std::ostringstream held_errors;
+  std::streambuf *cerr_buf = nullptr;
+
+  // null unless options.stats asks for them
+  std::unique_ptr<Stats> stats;
+
+  // null unless options.profile or options.profile_input is set
+  std::unique_ptr<Profile> profile;
+  std::unique_ptr<Codegen> codegen;
+
 public:
-  explicit Compiler(std::istream &input)
-      : lexer(std::make_unique<Lexer>(input)), cur_token(256),
-        input(input), precedence{{'<', 10}, {'>', 10}, {'+', 20},
-                                 {'-', 20}, {'*', 40}, {'/', 40}}
+  // interactive mode, reads from a stream
+  explicit Compiler(std::istream &input, const Options &options = Options())
+      : Compiler(std::make_unique<Lexer>(input), options) {}
+
+  // whole-buffer mode, e.g. a memory-mapped source file
+  explicit Compiler(std::unique_ptr<llvm::MemoryBuffer> source,
+                    const Options &options = Options())
+      : Compiler(std::make_unique<Lexer>(std::move(source)), options) {}
+
+  // library mode, source text is handed over by add_source()
+  explicit Compiler(const Options &options)
+      : Compiler(std::unique_ptr<Lexer>(), options) {}
+
+  Compiler(std::unique_ptr<Lexer> lexer, const Options &options)
+      : lexer(std::move(lexer)), cur_token(256),
+        arena(std::make_unique<Arena>()),
+        resolver(functions, options.concurrent || options.rebinds()),
+        folder(functions, !options.concurrent && !options.rebinds()),
+        options(options),
+        precedence{{'=', 2},  {'<', 10}, {'>', 10}, {'+', 20},
+                   {'-', 20}, {'*', 40}, {'/', 40}}
   // initializing precedence table
   {
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
+    if (this->options.stats != Options::stats_none)
+      stats = std::make_unique<Stats>();
+    if (this->options.profile != Options::profile_none ||
+        !this->options.profile_input.empty()) {
+      profile = std::make_unique<Profile>(functions, this->options);
+      // carries on without it
+      if (!this->options.profile_input.empty())
+        profile->load(this->options.profile_input);
+    }
+    codegen = std::make_unique<Codegen>(functions, this->options, stats.get(),
+                                        profile.get());
   }
 
-  void compile();
+  // runs the REPL, or ahead of time compiles the whole input and writes the
+  // output file; false if that failed
+  bool compile();
+
+  // library mode: generates the definitions and externs in source into one
+  // module and adds it to the JIT as module, with the ids it defines in
+  // defined. False if some item had errors; those are reported and left out
+  // and the rest is added all the same. Top-level expressions are errors,
+  // nothing is run.
+  bool add_source(std::unique_ptr<llvm::MemoryBuffer> source,
+                  llvm::orc::KaleidoscopeJIT::ModuleKey &module,
+                  std::vector<unsigned> &defined);
+
+  // parses every item in source without compiling anything, handing each
+  // definition and top-level expression to parsed before its arena is reset;
+  // for the benchmarks. Returns the number of items parsed.
+  unsigned parse_source(std::unique_ptr<llvm::MemoryBuffer> source,
+                        llvm::function_ref<void(FunctionAST *)> parsed);
+
+  // the timing and counter report in the format options.stats asks for,
+  // nothing if it's off
+  void print_stats(llvm::raw_ostream &out) const;
+  const Stats *get_stats() const { return stats.get(); }
+
+  // null unless profiling
+  const Profile *get_profile() const { return profile.get(); }
+
+  FunctionTable &get_functions() { return functions; }
+  Codegen &get_codegen() { return *codegen; }
 
 private:
+  // times parsing one item as Stats::parse, but for the lexing get_tok()
+  // did meanwhile, which counts as Stats::lex: a Stats::Timer per token
+  // would cost more than lexing it
+  class ParseTimer {
+    Compiler &compiler;
+    ParseTimer *outer;
+    Stats::Timer timer;
+
+  public:
+    uint64_t tokens = 0;
+    std::chrono::steady_clock::duration lexing{};
+
+    explicit ParseTimer(Compiler &compiler)
+        : compiler(compiler), outer(compiler.parse_timer),
+          timer(compiler.stats.get(), Stats::parse) {
+      compiler.parse_timer = this;
+    }
+    ~ParseTimer();
+  };
+
+  // the item being parsed, if stats are on
+  ParseTimer *parse_timer = nullptr;
+
   // returning the precedence of current token
   int get_tok_precedence();
 
@@ -43,43 +156,72 @@ private:
   void get_tok();
 
   // numberexpr ::= number
-  std::unique_ptr<ExprAST> parse_number_expr();
+  ExprAST *parse_number_expr();
 
   // parenexpr ::= '(' expr ')'
-  std::unique_ptr<ExprAST> parse_paren_expr();
+  ExprAST *parse_paren_expr();
 
   // identifierexpr ::= identifier
   //                ::= identifier '(' expression* ')'
-  std::unique_ptr<ExprAST> parse_ident_expr();
+  ExprAST *parse_ident_expr();
+
+  // ifexpr ::= 'if' expression 'then' expression 'else' expression
+  ExprAST *parse_if_expr();
+
+  // forexpr ::= 'for' identifier '=' expression ',' expression
+  //             (',' expression)? 'in' expression
+  ExprAST *parse_for_expr();
+
+  // varexpr ::= 'var' identifier ('=' expression)?
+  //             (',' identifier ('=' expression)?)* 'in' expression
+  ExprAST *parse_var_expr();
 
   // primary ::= identifierexpr
   //         ::= numberexpr
   //         ::= parenexpr
-  std::unique_ptr<ExprAST> parse_primary();
+  //         ::= ifexpr
+  //         ::= forexpr
+  //         ::= varexpr
+  ExprAST *parse_primary();
 
   // expression ::= primary binoprhs
-  std::unique_ptr<ExprAST> parse_expr();
+  ExprAST *parse_expr();
 
-  // binoprhs ::= (op primary)*
-  std::unique_ptr<ExprAST> parse_binop_rhs(int expr_prec,
-                                           std::unique_ptr<ExprAST> LHS);
+  // binoprhs ::= (op primary)*, where the left of an '=' is a variable
+  ExprAST *parse_binop_rhs(int expr_prec, ExprAST *LHS);
 
   // prototype ::= id '(' id* ')'
-  std::unique_ptr<PrototypeAST> parse_prototype();
+  PrototypeAST *parse_prototype();
 
   // extern ::= 'extern' prototype
-  std::unique_ptr<PrototypeAST> parse_extern();
+  PrototypeAST *parse_extern();
 
   // definition ::= 'def' prototype expression
-  std::unique_ptr<FunctionAST> parse_definition();
+  FunctionAST *parse_definition();
 
   // toplevelexpr ::= expression
-  std::unique_ptr<FunctionAST> parse_top_level();
+  FunctionAST *parse_top_level();
+
+  // the Resolver, Folder (if enabled) and Interpreter, timed
+  bool resolve(FunctionAST *fn);
+  bool resolve(PrototypeAST *proto);
+  void fold(FunctionAST *fn);
+  bool interpret(const FunctionAST *fn, double &result);
+
+  // handlers, false if the item had errors
+  bool handle_def();
+  bool handle_extern();
+  void handle_top_level();
+
+  // prompts and IR dumps are only for the REPL
+  bool interactive() const { return !options.aot() && !options.batch; }
+
+  // ahead of time, writes the object or links the executable
+  bool emit();
 
-  // handlers
-  void handle_def(Codegen &codegen);
-  void handle_extern(Codegen &codegen);
-  void handle_top_level(Codegen &codegen);
+  // batch mode: runs the top-level expressions generated so far, so their
+  // results come out before anything reported after them
+  void run_top_level();
 
   //module initializer
   void init_module_and_pass_mngr(void);
@@ -0,0 +1,61 @@
+#include "Epoch.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+EpochManager::~EpochManager() {
+  for (Record *r = records.load(); r;) {
+    Record *next = r->next;
+    delete r;
+    r = next;
+  }
+}
+
+EpochManager::Guard EpochManager::pin() {
+  // reuse a free record, or push a new one
+  Record *r = records.load(std::memory_order_acquire);
+  for (; r; r = r->next) {
+    bool expected = false;
+    if (!r->used.load(std::memory_order_relaxed) &&
+        r->used.compare_exchange_strong(expected, true,
+                                        std::memory_order_acquire))
+      break;
+  }
+  if (!r) {
+    r = new Record;
+    r->used.store(true, std::memory_order_relaxed);
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+      ;
+  }
+
+  // the fence orders the announcement before every load the reader makes
+  // under the pin: if collect() misses it, the reader already sees what the
+  // writer unlinked before retiring
+  r->epoch.store(global_epoch.load());
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return Guard(r);
+}
+
+void EpochManager::retire(std::function<void()> reclaim) {
+  // readers pinned at this epoch or before may still hold the object
+  retired.push_back({global_epoch.fetch_add(1), std::move(reclaim)});
+}
+
+void EpochManager::collect() {
+  uint64_t oldest = UINT64_MAX;
+  for (Record *r = records.load(); r; r = r->next)
+    if (uint64_t epoch = r->epoch.load())
+      oldest = std::min(oldest, epoch);
+
+  auto safe = std::stable_partition(
+      retired.begin(), retired.end(),
+      [oldest](const Retired &item) { return item.epoch >= oldest; });
+  std::vector<Retired> reclaimable(std::make_move_iterator(safe),
+                                   std::make_move_iterator(retired.end()));
+  retired.erase(safe, retired.end());
+  for (auto &item : reclaimable)
+    item.reclaim();
+}
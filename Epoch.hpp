@@ -0,0 +1,70 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// EpochManager - epoch-based reclamation. A reader pins the current epoch
+// for as long as it may use a shared object; a writer unlinks the object
+// first and then retires it, and collect() reclaims it once every reader that
+// was pinned when it was retired has let go. Pinning takes a record from a
+// lock-free list, so readers never wait for the writer; retire() and
+// collect() are for one writer thread at a time.
+class EpochManager {
+  struct Record {
+    std::atomic<bool> used{false};
+    std::atomic<uint64_t> epoch{0}; // 0 while not pinned
+    Record *next = nullptr;
+  };
+
+  std::atomic<uint64_t> global_epoch{1};
+  std::atomic<Record *> records{nullptr}; // never shrinks
+
+  struct Retired {
+    uint64_t epoch;
+    std::function<void()> reclaim;
+  };
+  std::vector<Retired> retired;
+
+public:
+  // keeps the epoch pinned until it goes out of scope
+  class Guard {
+    Record *record;
+
+    friend class EpochManager;
+    explicit Guard(Record *record) : record(record) {}
+
+  public:
+    Guard(Guard &&other) : record(other.record) { other.record = nullptr; }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+    ~Guard() {
+      if (!record)
+        return;
+      record->epoch.store(0, std::memory_order_release);
+      record->used.store(false, std::memory_order_release);
+    }
+  };
+
+  EpochManager() = default;
+  EpochManager(const EpochManager &) = delete;
+  EpochManager &operator=(const EpochManager &) = delete;
+
+  // whatever is still retired is dropped without being reclaimed, readers
+  // must be gone by now
+  ~EpochManager();
+
+  Guard pin();
+
+  // calls reclaim once no reader can still see the object; the object must
+  // already be unreachable for readers that pin from now on
+  void retire(std::function<void()> reclaim);
+
+  // reclaims what no pinned reader can see anymore
+  void collect();
+};
+
+#endif // EPOCH_HPP
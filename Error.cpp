@@ -1,11 +1,11 @@
 #include "Error.hpp"
 
-std::unique_ptr<ast::ExprAST> log_error(const char *err) {
+ast::ExprAST *log_error(const char *err) {
   std::cerr << "Error: " << err << std::endl << std::flush;
   return nullptr;
 }
 
-std::unique_ptr<ast::PrototypeAST> log_errorP(const char *err) {
+ast::PrototypeAST *log_errorP(const char *err) {
   log_error(err);
   return nullptr;
 }
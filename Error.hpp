@@ -4,9 +4,9 @@
 #include "AST.hpp"
 
 // Error logging facility
-std::unique_ptr<ast::ExprAST> log_error(const char *err);
+ast::ExprAST *log_error(const char *err);
 
-std::unique_ptr<ast::PrototypeAST> log_errorP(const char *err);
+ast::PrototypeAST *log_errorP(const char *err);
 
 llvm::Value *log_errorV(const char *err);
 
@@ -0,0 +1,109 @@
+#include "Evaluator.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+
+namespace ast {
+bool Evaluator::apply(char op, double L, double R, double &result) {
+  switch (op) {
+  case '+':
+    result = L + R;
+    return true;
+  case '-':
+    result = L - R;
+    return true;
+  case '*':
+    result = L * R;
+    return true;
+  case '<':
+    result = !(L >= R) ? 1.0 : 0.0; // unordered less-than, like FCmpULT
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool Evaluator::has_current_body(unsigned id) const {
+  return functions.get(id).def && !functions.is_stale(id);
+}
+
+double Evaluator::eval(const ExprAST *expr, double *frame) {
+  if (failed || (limited && !fuel--)) {
+    failed = true;
+    return 0;
+  }
+
+  switch (expr->get_kind()) {
+  case ExprAST::expr_number:
+    return llvm::cast<NumberExprAST>(expr)->get_val();
+
+  case ExprAST::expr_variable:
+    return frame[llvm::cast<VariableExprAST>(expr)->get_slot()];
+
+  case ExprAST::expr_binary: {
+    auto bin = llvm::cast<BinaryExprAST>(expr);
+    double L = eval(bin->get_lhs(), frame);
+    double R = eval(bin->get_rhs(), frame);
+    double result = 0;
+    if (!apply(bin->get_op(), L, R, result))
+      failed = true;
+    return result;
+  }
+
+  case ExprAST::expr_call: {
+    auto call_ast = llvm::cast<CallExprAST>(expr);
+    llvm::SmallVector<double, 8> args;
+    for (auto arg : call_ast->get_args())
+      args.push_back(eval(arg, frame));
+    return call(call_ast->get_callee_id(), args);
+  }
+
+  case ExprAST::expr_if: {
+    auto node = llvm::cast<IfExprAST>(expr);
+    return is_true(eval(node->get_cond(), frame))
+               ? eval(node->get_then(), frame)
+               : eval(node->get_else(), frame);
+  }
+
+  case ExprAST::expr_for: {
+    auto node = llvm::cast<ForExprAST>(expr);
+    double &var = frame[node->get_slot()];
+    var = eval(node->get_start(), frame);
+    // with a budget every eval() takes fuel, so a loop that doesn't end fails
+    while (!failed && is_true(eval(node->get_end(), frame))) {
+      eval(node->get_body(), frame);
+      // the body or the step may assign var
+      double step = node->get_step() ? eval(node->get_step(), frame) : 1.0;
+      var += step;
+    }
+    return 0;
+  }
+
+  case ExprAST::expr_var: {
+    auto node = llvm::cast<VarExprAST>(expr);
+    unsigned slot = node->get_slot();
+    for (auto init : node->get_inits())
+      frame[slot++] = init ? eval(init, frame) : 0.0;
+    return eval(node->get_body(), frame);
+  }
+
+  case ExprAST::expr_assign: {
+    auto node = llvm::cast<AssignExprAST>(expr);
+    double value = eval(node->get_value(), frame);
+    frame[node->get_var()->get_slot()] = value;
+    return value;
+  }
+  }
+
+  failed = true;
+  return 0;
+}
+
+double Evaluator::eval_body(const FunctionAST *def,
+                            llvm::ArrayRef<double> args) {
+  // the arguments, then room for the loop variables
+  llvm::SmallVector<double, 8> frame(args.begin(), args.end());
+  frame.resize(def->get_frame_size());
+  return eval(def->get_body(), frame.data());
+}
+} // namespace ast
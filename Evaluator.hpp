@@ -0,0 +1,56 @@
+#ifndef EVALUATOR_HPP
+#define EVALUATOR_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "AST.hpp"
+#include "FunctionTable.hpp"
+
+namespace ast {
+// Evaluator - walks an expression straight off the AST, with the semantics of
+// the code Codegen emits for it. The Folder and the Interpreter derive from
+// it and decide what a call does.
+//
+// An evaluation may be given a budget of steps, since recursion and loops
+// need not terminate; once it runs out, or a derived class sets failed, the
+// rest of the evaluation unwinds without doing anything and its result is
+// meaningless.
+class Evaluator {
+protected:
+  FunctionTable &functions;
+
+  // steps left when limited, every eval() takes one
+  bool limited;
+  unsigned fuel;
+  bool failed;
+
+  explicit Evaluator(FunctionTable &functions, bool limited = false)
+      : functions(functions), limited(limited), fuel(0), failed(false) {}
+  ~Evaluator() = default;
+
+  // same semantics as Codegen::visit(BinaryExprAST), false for operators it
+  // rejects
+  static bool apply(char op, double L, double R, double &result);
+  // whether apply() takes op
+  static bool knows(char op) {
+    double result;
+    return apply(op, 0, 0, result);
+  }
+
+  // whether the body of id can be evaluated in place of its code: it has
+  // one, and it calls the definitions its code does (see
+  // FunctionTable::is_stale)
+  bool has_current_body(unsigned id) const;
+
+  // frame holds the arguments and loop variables of the function being
+  // evaluated
+  double eval(const ExprAST *expr, double *frame);
+
+  // evaluates the body of def on a frame of args
+  double eval_body(const FunctionAST *def, llvm::ArrayRef<double> args);
+
+  virtual double call(unsigned id, llvm::ArrayRef<double> args) = 0;
+};
+} // namespace ast
+
+#endif // EVALUATOR_HPP
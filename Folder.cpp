@@ -0,0 +1,137 @@
+#include "Folder.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+
+namespace ast {
+namespace {
+// steps and nested calls one compile-time evaluation may take
+const unsigned max_fuel = 100000;
+const unsigned max_depth = 256;
+} // namespace
+
+void Folder::fold(FunctionAST *fn, Arena &arena) {
+  this->arena = &arena;
+  self = fn->get_proto()->get_id();
+  fn->set_body(fold(fn->get_body()));
+}
+
+ExprAST *Folder::fold(ExprAST *expr) {
+  switch (expr->get_kind()) {
+  case ExprAST::expr_number:
+  case ExprAST::expr_variable:
+    return expr;
+
+  case ExprAST::expr_binary: {
+    auto bin = llvm::cast<BinaryExprAST>(expr);
+    bin->set_lhs(fold(bin->get_lhs()));
+    bin->set_rhs(fold(bin->get_rhs()));
+
+    auto L = llvm::dyn_cast<NumberExprAST>(bin->get_lhs());
+    auto R = llvm::dyn_cast<NumberExprAST>(bin->get_rhs());
+    double result;
+    if (L && R && apply(bin->get_op(), L->get_val(), R->get_val(), result))
+      return arena->make<NumberExprAST>(result);
+    return bin;
+  }
+
+  case ExprAST::expr_call: {
+    auto call_ast = llvm::cast<CallExprAST>(expr);
+    llvm::SmallVector<ExprAST *, 8> args;
+    llvm::SmallVector<double, 8> values;
+    bool changed = false, constant = true, simple = true;
+    for (auto arg : call_ast->get_args()) {
+      args.push_back(fold(arg));
+      changed |= args.back() != arg;
+      if (auto num = llvm::dyn_cast<NumberExprAST>(args.back()))
+        values.push_back(num->get_val());
+      else
+        constant = false;
+      simple &= llvm::isa<NumberExprAST>(args.back()) ||
+                llvm::isa<VariableExprAST>(args.back());
+    }
+    if (changed)
+      call_ast->set_args(arena->copy(llvm::ArrayRef<ExprAST *>(args)));
+
+    unsigned id = call_ast->get_callee_id();
+    if (id == self || !fold_calls)
+      return call_ast;
+
+    // a constant body; the arguments can only be dropped if evaluating them
+    // does nothing
+    auto &info = functions.get(id);
+    if (info.def && simple)
+      if (auto num = llvm::dyn_cast<NumberExprAST>(info.def->get_body()))
+        return arena->make<NumberExprAST>(num->get_val());
+
+    double result;
+    if (constant && evaluate(id, values, result))
+      return arena->make<NumberExprAST>(result);
+    return call_ast;
+  }
+
+  case ExprAST::expr_if: {
+    auto node = llvm::cast<IfExprAST>(expr);
+    node->set_cond(fold(node->get_cond()));
+    node->set_then(fold(node->get_then()));
+    node->set_else(fold(node->get_else()));
+    if (auto cond = llvm::dyn_cast<NumberExprAST>(node->get_cond()))
+      return is_true(cond->get_val()) ? node->get_then() : node->get_else();
+    return node;
+  }
+
+  case ExprAST::expr_for: {
+    auto node = llvm::cast<ForExprAST>(expr);
+    node->set_start(fold(node->get_start()));
+    node->set_end(fold(node->get_end()));
+    if (node->get_step())
+      node->set_step(fold(node->get_step()));
+    node->set_body(fold(node->get_body()));
+    return node;
+  }
+
+  case ExprAST::expr_var: {
+    auto node = llvm::cast<VarExprAST>(expr);
+    llvm::SmallVector<ExprAST *, 4> inits;
+    bool changed = false;
+    for (auto init : node->get_inits()) {
+      inits.push_back(init ? fold(init) : nullptr);
+      changed |= inits.back() != init;
+    }
+    if (changed)
+      node->set_inits(arena->copy(llvm::ArrayRef<ExprAST *>(inits)));
+    node->set_body(fold(node->get_body()));
+    return node;
+  }
+
+  case ExprAST::expr_assign: {
+    auto node = llvm::cast<AssignExprAST>(expr);
+    node->set_value(fold(node->get_value()));
+    return node;
+  }
+  }
+  return expr;
+}
+
+bool Folder::evaluate(unsigned id, llvm::ArrayRef<double> args,
+                      double &result) {
+  fuel = max_fuel;
+  depth = 0;
+  failed = false;
+  result = call(id, args);
+  return !failed;
+}
+
+double Folder::call(unsigned id, llvm::ArrayRef<double> args) {
+  auto &info = functions.get(id);
+  if (failed || !has_current_body(id) || !info.pure || depth == max_depth) {
+    failed = true;
+    return 0;
+  }
+
+  depth++;
+  double result = eval_body(info.def, args);
+  depth--;
+  return result;
+}
+} // namespace ast
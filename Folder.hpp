@@ -0,0 +1,57 @@
+#ifndef FOLDER_HPP
+#define FOLDER_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "AST.hpp"
+#include "Arena.hpp"
+#include "Evaluator.hpp"
+#include "FunctionTable.hpp"
+
+namespace ast {
+// Folder - runs between the Resolver and Codegen. It folds arithmetic on
+// literals and evaluates calls to pure functions whose arguments are all
+// constant, so a closed top-level expression is a single NumberExprAST by the
+// time it would reach the JIT. A call to a function whose body is a constant
+// becomes that constant, and an if with a constant condition the branch it
+// takes.
+//
+// Evaluation goes through the definitions in the function table, so it stops
+// at functions that are impure or stale (see FunctionTable::is_stale), and at
+// a fixed budget of steps, since recursion and loops need not terminate.
+//
+// Without fold_calls, calls are left as they are: in concurrent mode, or
+// when callers are rebound to redefinitions, a call may run a definition
+// that comes later.
+class Folder final : Evaluator {
+  bool fold_calls;
+
+  // where new nodes go, the arena of the item being folded
+  Arena *arena;
+
+  // function being folded, its calls to itself are left alone
+  unsigned self;
+
+  // nested calls of the current evaluation
+  unsigned depth;
+
+public:
+  explicit Folder(FunctionTable &functions, bool fold_calls = true)
+      : Evaluator(functions, true), fold_calls(fold_calls), arena(nullptr),
+        self(~0u), depth(0) {}
+
+  // folds the body of fn in place
+  void fold(FunctionAST *fn, Arena &arena);
+
+private:
+  ExprAST *fold(ExprAST *expr);
+
+  // the value of a call with constant arguments, false if it can't be
+  // evaluated at compile time
+  bool evaluate(unsigned id, llvm::ArrayRef<double> args, double &result);
+
+  double call(unsigned id, llvm::ArrayRef<double> args) override;
+};
+} // namespace ast
+
+#endif // FOLDER_HPP
@@ -0,0 +1,74 @@
+#include "FunctionTable.hpp"
+
+#include <algorithm>
+
+namespace ast {
+unsigned FunctionTable::declare(PrototypeAST *proto) {
+  unsigned sym = proto->get_name().get_id();
+  if (sym >= ids.size())
+    ids.resize(sym + 1, -1);
+
+  if (ids[sym] < 0) {
+    ids[sym] = functions.size();
+    functions.emplace_back();
+    functions.back().name = proto->get_name();
+  }
+
+  unsigned id = ids[sym];
+  proto->set_id(id);
+  functions[id].proto = proto->clone(proto_arena);
+  return id;
+}
+
+void FunctionTable::define(const FunctionAST *def, std::unique_ptr<Arena> arena,
+                           std::vector<unsigned> callees) {
+  unsigned id = def->get_proto()->get_id();
+  auto &info = functions[id];
+  for (unsigned callee : info.callees) {
+    auto &callers = functions[callee].callers;
+    callers.erase(std::find(callers.begin(), callers.end(), id));
+  }
+  for (unsigned callee : callees)
+    functions[callee].callers.push_back(id);
+
+  info.def = def;
+  info.arena = std::move(arena);
+  info.callees = std::move(callees);
+  rebind(id);
+
+  info.pure = true;
+  for (unsigned callee : info.callees)
+    if (callee != id && !functions[callee].pure)
+      info.pure = false;
+}
+
+void FunctionTable::rebind(unsigned id) {
+  auto &info = functions[id];
+  info.version = next_version++;
+  info.calls = 0;
+  info.addr = nullptr;
+}
+
+std::vector<unsigned> FunctionTable::dependents(unsigned id) const {
+  std::vector<unsigned> result{id};
+  std::vector<bool> seen(functions.size());
+  seen[id] = true;
+  // breadth first, result doubles as the work list
+  for (unsigned i = 0; i < result.size(); i++)
+    for (unsigned caller : functions[result[i]].callers)
+      if (!seen[caller]) {
+        seen[caller] = true;
+        result.push_back(caller);
+      }
+  result.erase(result.begin());
+  return result;
+}
+
+bool FunctionTable::is_stale(unsigned id) const {
+  auto &info = functions[id];
+  for (unsigned callee : info.callees)
+    if (functions[callee].version > info.version)
+      return true;
+  return false;
+}
+} // namespace ast
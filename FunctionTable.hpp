@@ -0,0 +1,94 @@
+#ifndef FUNCTION_TABLE_HPP
+#define FUNCTION_TABLE_HPP
+
+#include <memory>
+#include <vector>
+
+#include "AST.hpp"
+#include "Arena.hpp"
+#include "Symbol.hpp"
+
+namespace ast {
+// FunctionInfo - everything known about one function id
+struct FunctionInfo {
+  Symbol name;
+  const PrototypeAST *proto = nullptr; // latest prototype
+
+  // latest definition, null for externs; the arena it was parsed in is kept
+  // alive until the function is redefined
+  const FunctionAST *def = nullptr;
+  std::unique_ptr<Arena> arena;
+
+  // functions called by the definition, and the defined functions whose
+  // definition calls this one
+  std::vector<unsigned> callees;
+  std::vector<unsigned> callers;
+
+  // grows with every definition in the table, and whenever one is generated
+  // again (see rebind()), so a function defined after this one has a larger
+  // version; 0 until the function is defined
+  unsigned version = 0;
+
+  // the definition calls nothing but pure functions (itself included), so a
+  // call has no side effects; externs are never pure
+  bool pure = false;
+
+  // tiering state: calls made through the interpreter, and the native entry
+  // point once the function has been JIT'd (or looked up, for externs)
+  unsigned calls = 0;
+  void *addr = nullptr;
+};
+
+// FunctionTable - maps function names to dense ids. An id is assigned the
+// first time a name is declared (by an extern or a def) and stays the same
+// when the function is redefined, so later passes can keep per-function state
+// in plain vectors indexed by id.
+class FunctionTable {
+  std::vector<int> ids; // indexed by Symbol id, -1 if not a function
+  std::vector<FunctionInfo> functions; // indexed by function id
+
+  // prototypes outlive the arena of the item they were parsed in
+  Arena proto_arena;
+
+  unsigned next_version = 1;
+
+public:
+  // records proto as the current prototype of its function, and stamps the
+  // function id into it
+  unsigned declare(PrototypeAST *proto);
+
+  // records def as the body of its (already declared) function, taking over
+  // the arena it lives in; resets the tiering state
+  void define(const FunctionAST *def, std::unique_ptr<Arena> arena,
+              std::vector<unsigned> callees);
+
+  // true once a callee of id has been redefined: the code generated for id
+  // still calls the old definition, so its AST no longer describes what it
+  // does
+  bool is_stale(unsigned id) const;
+
+  // every defined function that calls id, directly or through others, id
+  // itself excepted; the ones whose code a redefinition of id leaves stale
+  std::vector<unsigned> dependents(unsigned id) const;
+
+  // records that the definition of id was generated again against the
+  // latest definitions of its callees: it gets a new version, so it is no
+  // longer stale, and its tiering state is reset
+  void rebind(unsigned id);
+
+  // version of the latest definition, 0 before the first one
+  unsigned last_version() const { return next_version - 1; }
+
+  // the id of the function called name, -1 if it was never declared
+  int lookup(Symbol name) const {
+    return name.get_id() < ids.size() ? ids[name.get_id()] : -1;
+  }
+
+  const FunctionInfo &get(unsigned id) const { return functions[id]; }
+  FunctionInfo &get(unsigned id) { return functions[id]; }
+
+  size_t size() const { return functions.size(); }
+};
+} // namespace ast
+
+#endif // FUNCTION_TABLE_HPP
@@ -0,0 +1,140 @@
+#include "Interpreter.hpp"
+
+#include "llvm/Support/Casting.h"
+
+namespace ast {
+namespace {
+// the most arguments call_native() knows how to pass
+const unsigned max_native_args = 8;
+
+// calls a JIT'd function or an extern through a pointer of the right arity
+double call_native(void *addr, llvm::ArrayRef<double> a) {
+  using f0 = double (*)();
+  using f1 = double (*)(double);
+  using f2 = double (*)(double, double);
+  using f3 = double (*)(double, double, double);
+  using f4 = double (*)(double, double, double, double);
+  using f5 = double (*)(double, double, double, double, double);
+  using f6 = double (*)(double, double, double, double, double, double);
+  using f7 = double (*)(double, double, double, double, double, double, double);
+  using f8 = double (*)(double, double, double, double, double, double, double,
+                        double);
+
+  switch (a.size()) {
+  case 0:
+    return ((f0)addr)();
+  case 1:
+    return ((f1)addr)(a[0]);
+  case 2:
+    return ((f2)addr)(a[0], a[1]);
+  case 3:
+    return ((f3)addr)(a[0], a[1], a[2]);
+  case 4:
+    return ((f4)addr)(a[0], a[1], a[2], a[3]);
+  case 5:
+    return ((f5)addr)(a[0], a[1], a[2], a[3], a[4]);
+  case 6:
+    return ((f6)addr)(a[0], a[1], a[2], a[3], a[4], a[5]);
+  case 7:
+    return ((f7)addr)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+  default:
+    return ((f8)addr)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+  }
+}
+} // namespace
+
+bool Interpreter::run(const FunctionAST *fn, double &result) {
+  std::vector<bool> seen(functions.size());
+  if (!check(fn->get_body(), seen))
+    return false;
+  result = eval_body(fn, {});
+  return true;
+}
+
+bool Interpreter::check(const ExprAST *expr, std::vector<bool> &seen) {
+  switch (expr->get_kind()) {
+  case ExprAST::expr_number:
+  case ExprAST::expr_variable:
+    return true;
+
+  case ExprAST::expr_binary: {
+    auto bin = llvm::cast<BinaryExprAST>(expr);
+    // the operators Codegen::visit(BinaryExprAST) knows, it reports the rest
+    if (!knows(bin->get_op()))
+      return false;
+    return check(bin->get_lhs(), seen) && check(bin->get_rhs(), seen);
+  }
+
+  case ExprAST::expr_call: {
+    auto call_ast = llvm::cast<CallExprAST>(expr);
+    for (auto arg : call_ast->get_args())
+      if (!check(arg, seen))
+        return false;
+
+    unsigned id = call_ast->get_callee_id();
+    auto &info = functions.get(id);
+    bool native = call_ast->get_args().size() <= max_native_args;
+    if (!info.def) {
+      // an extern, look it up in the host process once
+      if (!info.addr)
+        info.addr = codegen.get_address(id);
+      return info.addr && native;
+    }
+    if (info.addr && native)
+      return true;
+    if (!has_current_body(id))
+      return false;
+    if (seen[id])
+      return true;
+    seen[id] = true;
+    return check(info.def->get_body(), seen);
+  }
+
+  case ExprAST::expr_if: {
+    auto node = llvm::cast<IfExprAST>(expr);
+    return check(node->get_cond(), seen) && check(node->get_then(), seen) &&
+           check(node->get_else(), seen);
+  }
+
+  case ExprAST::expr_for: {
+    auto node = llvm::cast<ForExprAST>(expr);
+    return check(node->get_start(), seen) && check(node->get_end(), seen) &&
+           (!node->get_step() || check(node->get_step(), seen)) &&
+           check(node->get_body(), seen);
+  }
+
+  case ExprAST::expr_var: {
+    auto node = llvm::cast<VarExprAST>(expr);
+    for (auto init : node->get_inits())
+      if (init && !check(init, seen))
+        return false;
+    return check(node->get_body(), seen);
+  }
+
+  case ExprAST::expr_assign: {
+    auto node = llvm::cast<AssignExprAST>(expr);
+    return check(node->get_value(), seen);
+  }
+  }
+  return false;
+}
+
+double Interpreter::call(unsigned id, llvm::ArrayRef<double> args) {
+  auto &info = functions.get(id);
+  bool native = args.size() <= max_native_args;
+
+  if (info.def && !info.addr && native && ++info.calls >= hot_threshold) {
+    // hot, promote it and everything it calls to native code; if that
+    // fails, codegen has reported why and it stays in the interpreter
+    info.addr = codegen.compile_function(id);
+    if (!info.addr)
+      info.calls = 0;
+  }
+
+  // externs, check() made sure they can be called
+  if (info.addr && native)
+    return call_native(info.addr, args);
+
+  return eval_body(info.def, args);
+}
+} // namespace ast
@@ -0,0 +1,46 @@
+#ifndef INTERPRETER_HPP
+#define INTERPRETER_HPP
+
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "AST.hpp"
+#include "Codegen.hpp"
+#include "Evaluator.hpp"
+#include "FunctionTable.hpp"
+
+namespace ast {
+// Interpreter - the first execution tier. Top-level expressions and cold
+// functions are evaluated straight off the AST, which costs nothing up front;
+// every interpreted call bumps the callee's counter, and once a function has
+// been called hot_threshold times it is handed to Codegen and runs natively
+// from then on.
+//
+// Calls bind the way they do in JIT'd code: a stale function (see
+// FunctionTable::is_stale) is never interpreted, since its AST calls newer
+// definitions than its code would; the Compiler compiles such functions
+// before it redefines what they call.
+class Interpreter final : Evaluator {
+  Codegen &codegen;
+  unsigned hot_threshold;
+
+public:
+  Interpreter(FunctionTable &functions, Codegen &codegen,
+              unsigned hot_threshold)
+      : Evaluator(functions), codegen(codegen), hot_threshold(hot_threshold) {}
+
+  // evaluates a top-level expression; false, before any of it has run, if it
+  // reaches something only the JIT can do, so it can go there instead
+  bool run(const FunctionAST *fn, double &result);
+
+private:
+  // whether expr, and every function it may interpret from there, can be
+  // evaluated to the end; seen holds the functions checked so far
+  bool check(const ExprAST *expr, std::vector<bool> &seen);
+
+  double call(unsigned id, llvm::ArrayRef<double> args) override;
+};
+} // namespace ast
+
+#endif // INTERPRETER_HPP
@@ -14,125 +14,541 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/iterator_range.h"
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
-#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
-#include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+
+#include "ObjectCache.hpp"
+#include "Optimizer.hpp"
+#include "Stats.hpp"
+
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+// TargetMachines built from one JITTargetMachineBuilder, one per thread and
+// backend level, on first use. A TargetMachine caches subtargets and must
+// not be shared between threads, but building one for every module costs
+// more than compiling a one-line definition.
+class ThreadTargetMachines {
+public:
+  explicit ThreadTargetMachines(JITTargetMachineBuilder JTMB)
+      : JTMB(std::move(JTMB)) {}
+
+  const JITTargetMachineBuilder &getBuilder() const { return JTMB; }
+
+  Expected<TargetMachine &> get(CodeGenOpt::Level Level) {
+    std::lock_guard<std::mutex> Lock(M);
+    auto &TM = TMs[{std::this_thread::get_id(), Level}];
+    if (!TM) {
+      auto B = JTMB;
+      B.setCodeGenOptLevel(Level);
+      auto NewTM = B.createTargetMachine();
+      if (!NewTM)
+        return NewTM.takeError();
+      TM = std::move(*NewTM);
+    }
+    return *TM;
+  }
+
+private:
+  JITTargetMachineBuilder JTMB;
+  std::mutex M; // guards TMs
+  std::map<std::pair<std::thread::id, CodeGenOpt::Level>,
+           std::unique_ptr<TargetMachine>>
+      TMs;
+};
+
+// Like ConcurrentIRCompiler, so that modules can be compiled on several
+// threads at once, at the backend level matching the -O level the module
+// asks for (see set_opt_level()). The backend is timed, and the objects it
+// produces counted, for Stats.
+class TimedIRCompiler : public IRCompileLayer::IRCompiler {
+public:
+  TimedIRCompiler(ThreadTargetMachines &TMs, unsigned OptLevel, Stats *S)
+      : IRCompiler(irManglingOptionsFromTargetOptions(
+            TMs.getBuilder().getOptions())),
+        TMs(TMs), OptLevel(OptLevel), S(S) {}
+
+  void setObjectCache(ObjectCache *Cache) { this->Cache = Cache; }
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    Stats::Timer T(S, Stats::emit);
+    auto TM = TMs.get(codegen_opt_level(get_opt_level(M, OptLevel)));
+    if (!TM)
+      return TM.takeError();
+    auto Obj = SimpleCompiler(*TM, Cache)(M);
+    if (S && Obj)
+      S->object_bytes += (*Obj)->getBufferSize();
+    return Obj;
+  }
+
+private:
+  ThreadTargetMachines &TMs;
+  unsigned OptLevel;
+  ObjectCache *Cache = nullptr;
+  Stats *S;
+};
+
+// SectionMemoryManager that counts what it hands out, for Stats. There is
+// one per object, destroyed when the module it came from is removed, so the
+// sections of a freed module stop counting then.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  explicit CountingMemoryManager(Stats *S) : S(S) {}
+  ~CountingMemoryManager() override { S->jit_memory -= Allocated; }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    S->code_bytes += Size;
+    S->jit_memory += Size;
+    Allocated += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    S->jit_memory += Size;
+    Allocated += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+private:
+  Stats *S;
+  uint64_t Allocated = 0;
+};
+
+// Every module added to the JIT gets its own JITDylib, linked against the
+// previously added ones newest first and then against the host process. A
+// REPL may redefine a function at any time, and this way new code binds to
+// the newest definition while old code keeps the one it was linked with.
+// A function declared by extern and defined later, as in mutual recursion,
+// is found in one shared forwarding JITDylib that comes last in every link
+// order: it re-exports the newest definition of each function that some
+// module called before it was defined, so adding a module never touches the
+// link order of the ones before it.
+//
+// With compile threads, materialization runs on a thread pool: addModule()
+// kicks off compilation of the module's functions in the background, unless
+// they call a function that isn't defined yet, and the calling thread only
+// blocks when it looks a symbol up.
+//
+// In lazy mode modules are added through ORC's CompileOnDemandLayer, with a
+// LazyCallThroughManager for the reentry path: every function is replaced by
+// an indirection stub, and is only optimized and compiled the first time the
+// stub is called. (Lazy mode first came in on the legacy ORCv1 layers, which
+// LLVM 14 no longer has; this is the only implementation.)
+//
+// Given a cache directory, compiled objects are kept on disk and reused by
+// later sessions (see DiskObjectCache).
+//
+// Modules are optimized at -O<OptLevel>, or at the level they ask for, on
+// their way to the compiler, so on the compile threads when there are any,
+// and per function in lazy mode. With FunctionPassesOnly, modules that don't
+// ask for a level only get the -O1 function simplification passes.
+//
+// Modules may be added and symbols looked up from any thread.
+//
+// Given Stats, optimization and the backend are timed, and the code and
+// memory the JIT produces are counted.
 class KaleidoscopeJIT {
 public:
-  using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
-  using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
-
-  KaleidoscopeJIT()
-      : Resolver(createLegacyLookupResolver(
-            ES,
-            [this](StringRef Name) {
-              return findMangledSymbol(std::string(Name));
-            },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                    [this](VModuleKey) {
-                      return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+  using ModuleKey = JITDylib *;
+
+  explicit KaleidoscopeJIT(
+      bool Lazy = false, unsigned NumCompileThreads = 0,
+      const std::string &CacheDir = "", unsigned OptLevel = 2,
+      bool FunctionPassesOnly = false, Stats *S = nullptr,
+      ast::Options::FPModel FPModel = ast::Options::fp_strict,
+      const std::string &CPU = "", ArrayRef<std::string> CPUFeatures = {})
+      : ES(createSession()),
+        JTMB(createJTMB(OptLevel, FPModel, CPU, CPUFeatures)),
+        TM(cantFail(JTMB.createTargetMachine())),
+        DL(cantFail(JTMB.getDefaultDataLayoutForTarget())),
+        Mangle(*ES, DL), OptLevel(OptLevel),
+        FunctionPassesOnly(FunctionPassesOnly), S(S), ThreadTMs(JTMB),
+        ObjectLayer(*ES,
+                    [S]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                      if (S)
+                        return std::make_unique<CountingMemoryManager>(S);
+                      return std::make_unique<SectionMemoryManager>();
                     }),
-        CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
-    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+        CompileLayer(*ES, ObjectLayer,
+                     std::make_unique<TimedIRCompiler>(ThreadTMs, OptLevel,
+                                                       S)),
+        OptimizeLayer(*ES, CompileLayer,
+                      [this](ThreadSafeModule TSM,
+                             const MaterializationResponsibility &) {
+                        return optimizeModule(std::move(TSM));
+                      }),
+        ProcessJD(ES->createBareJITDylib("<process>")),
+        ForwardJD(ES->createBareJITDylib("<forward>")) {
+    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    }
+
+    if (!CacheDir.empty()) {
+      Cache = std::make_unique<DiskObjectCache>(
+          CacheDir, JTMB.getTargetTriple().str() + " " + JTMB.getCPU() + " " +
+                        JTMB.getFeatures().getString() + " -O" +
+                        std::to_string(OptLevel) +
+                        (FunctionPassesOnly ? " functions" : "") + " fp" +
+                        std::to_string(FPModel));
+      static_cast<TimedIRCompiler &>(CompileLayer.getCompiler())
+          .setObjectCache(Cache.get());
+    }
+
+    ProcessJD.addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+
+    if (NumCompileThreads > 0) {
+      CompileThreads = std::make_unique<ThreadPool>(
+          hardware_concurrency(NumCompileThreads));
+      ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+        // FIXME: ThreadPool tasks must be copyable, so hand the task over
+        // as a raw pointer.
+        CompileThreads->async([UnownedT = T.release()]() {
+          std::unique_ptr<Task> T(UnownedT);
+          T->run();
+        });
+      });
+    }
+
+    if (Lazy) {
+      LCTMgr = cantFail(createLocalLazyCallThroughManager(
+          JTMB.getTargetTriple(), *ES,
+          pointerToJITTargetAddress(&lazyCompileFailed)));
+      // one partition per function, so only what is called gets compiled
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *ES, OptimizeLayer, *LCTMgr,
+          createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple()));
+      CODLayer->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    }
+
+    rebuildSearchOrder();
+  }
+
+  ~KaleidoscopeJIT() {
+    if (CompileThreads)
+      CompileThreads->wait();
+    if (auto Err = ES->endSession())
+      ES->reportError(std::move(Err));
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
-    auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
-    return K;
+  const DataLayout &getDataLayout() const { return DL; }
+
+  bool isLazy() const { return CODLayer != nullptr; }
+
+  // null unless a cache directory was given
+  DiskObjectCache *getObjectCache() { return Cache.get(); }
+
+  // A module that cannot be added is reported to the session, and its key
+  // then has no symbols: looking them up fails.
+  ModuleKey addModule(ThreadSafeModule TSM) {
+    std::lock_guard<std::mutex> Lock(DylibsMutex);
+    auto &JD = ES->createBareJITDylib("module." + std::to_string(NextId++));
+
+    // newest definitions first, then the host process, then the ones to
+    // come
+    JITDylibSearchOrder LinkOrder;
+    for (auto *D : make_range(Dylibs.rbegin(), Dylibs.rend()))
+      LinkOrder.push_back({D, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    LinkOrder.push_back(
+        {&ProcessJD, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    LinkOrder.push_back(
+        {&ForwardJD, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    JD.setLinkOrder(std::move(LinkOrder));
+
+    // the functions defined here, and whether the ones they call are all
+    // defined already: one defined later can't be linked against yet, and
+    // is then linked through ForwardJD
+    SymbolNameVector Names;
+    bool Linkable = true;
+    TSM.withModuleDo([&](Module &M) {
+      for (auto &F : M) {
+        if (!F.isDeclaration() && F.hasExternalLinkage()) {
+          Names.push_back(Mangle(F.getName()));
+        } else if (F.isDeclaration() && !F.isIntrinsic() && !F.use_empty()) {
+          auto Name = Mangle(F.getName());
+          if (Defined.count(Name) ||
+              sys::DynamicLibrary::SearchForAddressOfSymbol(F.getName().str()))
+            continue;
+          Linkable = false;
+          Forwarded.insert({Name, nullptr});
+        }
+      }
+    });
+
+    Error Err = CODLayer ? CODLayer->add(JD, std::move(TSM))
+                         : OptimizeLayer.add(JD, std::move(TSM));
+    if (Err) {
+      ES->reportError(std::move(Err));
+      Names.clear();
+    }
+
+    Dylibs.push_back(&JD);
+    rebuildSearchOrder();
+    for (auto &Name : Names) {
+      ++Defined[Name];
+      if (Forwarded.count(Name))
+        forward(Name, &JD);
+    }
+    DefinedIn[&JD] = Names;
+
+    // start compiling them right away
+    if (!CODLayer && CompileThreads && Linkable && !Names.empty())
+      ES->lookup(
+          LookupKind::Static, makeJITDylibSearchOrder(&JD),
+          SymbolLookupSet(Names),
+          SymbolState::Ready,
+          [this](Expected<SymbolMap> Result) {
+            if (!Result)
+              ES->reportError(Result.takeError());
+          },
+          NoDependenciesToRegister);
+
+    return &JD;
   }
 
-  void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+  // Adds a module whose functions no other module calls by name: only
+  // lookupAsync() on the key returned finds them. All such modules share
+  // one JITDylib, which no link order or lookup() searches, and stay until
+  // the JIT goes away; each links against the modules added before it.
+  ModuleKey addPrivateModule(ThreadSafeModule TSM) {
+    std::lock_guard<std::mutex> Lock(DylibsMutex);
+    if (!PrivateJD)
+      PrivateJD = &ES->createBareJITDylib("private");
+    JITDylibSearchOrder LinkOrder = SearchOrder;
+    LinkOrder.push_back(
+        {&ForwardJD, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    PrivateJD->setLinkOrder(std::move(LinkOrder), false);
+    Error Err = CODLayer ? CODLayer->add(*PrivateJD, std::move(TSM))
+                         : OptimizeLayer.add(*PrivateJD, std::move(TSM));
+    if (Err)
+      ES->reportError(std::move(Err));
+    return PrivateJD;
   }
 
-  JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+  // Runs the passes M would get on its way to the compiler, untimed, to show
+  // what is going to be compiled.
+  Error optimize(Module &M) { return runPasses(M, nullptr); }
+
+  // Code that still calls into K must not run afterwards.
+  void removeModule(ModuleKey K) {
+    // the compile task that made K's symbols ready may not have returned yet
+    if (CompileThreads)
+      CompileThreads->wait();
+    std::lock_guard<std::mutex> Lock(DylibsMutex);
+    // only the modules added after K link against it
+    auto Pos = Dylibs.erase(find(Dylibs, K));
+    for (auto *D : make_range(Pos, Dylibs.end()))
+      D->removeFromLinkOrder(*K);
+    if (PrivateJD)
+      PrivateJD->removeFromLinkOrder(*K);
+    rebuildSearchOrder();
+    for (auto &Name : DefinedIn[K]) {
+      if (!--Defined[Name])
+        Defined.erase(Name);
+      // forward to the newest definition left, if any
+      auto It = Forwarded.find(Name);
+      if (It != Forwarded.end() && It->second == K) {
+        auto Newest = find_if(reverse(Dylibs), [&](JITDylib *D) {
+          return is_contained(DefinedIn[D], Name);
+        });
+        forward(Name, Newest == Dylibs.rend() ? nullptr : *Newest);
+      }
+    }
+    DefinedIn.erase(K);
+    if (auto Err = ES->removeJITDylib(*K))
+      ES->reportError(std::move(Err));
   }
 
-private:
-  std::string mangle(const std::string &Name) {
-    std::string MangledName;
+  // Search modules in reverse order: from last added to first added, then the
+  // host process. This is the opposite of the usual search order for dlsym,
+  // but makes more sense in a REPL where we want to bind to the newest
+  // available definition. Blocks until the symbol has been compiled.
+  //
+  // With compile threads, ORC may report the symbol ready while an object
+  // it calls into is still being linked on another thread, with its code
+  // not yet executable, so this also waits for the compile threads before
+  // handing out an address that is about to be called.
+  Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    JITDylibSearchOrder Order;
     {
-      raw_string_ostream MangledNameStream(MangledName);
-      Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
+      std::lock_guard<std::mutex> Lock(DylibsMutex);
+      Order = SearchOrder;
     }
-    return MangledName;
-  }
-
-  JITSymbol findMangledSymbol(const std::string &Name) {
-#ifdef _WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
-#else
-    const bool ExportedSymbolsOnly = true;
-#endif
-
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
-        return Sym;
-
-    // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-      return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-
-#ifdef _WIN32
-    // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
-    // GetProcAddress and standard libraries like msvcrt.dll use names
-    // with and without "_" (for example "_itoa" but "sin").
-    if (Name.length() > 2 && Name[0] == '_')
-      if (auto SymAddr =
-              RTDyldMemoryManager::getSymbolAddressInProcess(Name.substr(1)))
-        return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-#endif
-
-    return nullptr;
-  }
-
-  ExecutionSession ES;
-  std::shared_ptr<SymbolResolver> Resolver;
+    auto Sym = ES->lookup(Order, Mangle(Name));
+    if (CompileThreads)
+      CompileThreads->wait();
+    return Sym;
+  }
+
+  // Looks Name up in K without waiting for it: OnReady gets its address, or
+  // the error, once it has been compiled. With compile threads that happens
+  // in the background, otherwise before this returns.
+  void lookupAsync(ModuleKey K, StringRef Name,
+                   unique_function<void(Expected<JITTargetAddress>)> OnReady) {
+    auto Symbol = Mangle(Name);
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(K),
+        SymbolLookupSet(Symbol), SymbolState::Ready,
+        [Symbol, OnReady = std::move(OnReady)](
+            Expected<SymbolMap> Result) mutable {
+          if (!Result)
+            OnReady(Result.takeError());
+          else
+            OnReady((*Result)[Symbol].getAddress());
+        },
+        NoDependenciesToRegister);
+  }
+
+private:
+  // where a stub jumps when the function behind it can't be compiled; the
+  // session has reported why, and the call has nothing to return
+  static void lazyCompileFailed() {
+    report_fatal_error("a function called through a lazy stub failed to "
+                       "compile",
+                       false);
+  }
+
+  static std::unique_ptr<ExecutionSession> createSession() {
+    auto EPC = cantFail(SelfExecutorProcessControl::Create());
+    return std::make_unique<ExecutionSession>(std::move(EPC));
+  }
+
+  static JITTargetMachineBuilder
+  createJTMB(unsigned OptLevel, ast::Options::FPModel FPModel,
+             const std::string &CPU, ArrayRef<std::string> CPUFeatures) {
+    auto JTMB = cantFail(JITTargetMachineBuilder::detectHost());
+    std::string TargetCPU = JTMB.getCPU();
+    select_cpu(TargetCPU, JTMB.getFeatures(), CPU, CPUFeatures);
+    JTMB.setCPU(TargetCPU);
+    JTMB.setCodeGenOptLevel(codegen_opt_level(OptLevel));
+    set_fp_model(JTMB.getOptions(), FPModel);
+    return JTMB;
+  }
+
+  Expected<ThreadSafeModule> optimizeModule(ThreadSafeModule TSM) {
+    Error Err =
+        TSM.withModuleDo([this](Module &M) { return runPasses(M, S); });
+    if (Err)
+      return Err;
+    return TSM;
+  }
+
+  Error runPasses(Module &M, Stats *S) {
+    unsigned Level = get_opt_level(M, OptLevel);
+    auto TM = ThreadTMs.get(codegen_opt_level(Level));
+    if (!TM)
+      return TM.takeError();
+    // a module that asks for a level of its own gets the whole pipeline
+    bool AsksForLevel = get_opt_level(M, ~0u) != ~0u;
+    optimize_module(M, &*TM, Level, S, FunctionPassesOnly && !AsksForLevel);
+    return Error::success();
+  }
+
+  // Points ForwardJD's re-export of Name at its definition in JD, or drops
+  // it if JD is null. Code already linked against the old one keeps it.
+  void forward(const SymbolStringPtr &Name, JITDylib *JD) {
+    auto &From = Forwarded[Name];
+    if (From) {
+      Error Err = ForwardJD.remove({Name});
+      // something is being linked against it right now
+      if (Err && CompileThreads) {
+        consumeError(std::move(Err));
+        CompileThreads->wait();
+        Err = ForwardJD.remove({Name});
+      }
+      if (Err) {
+        ES->reportError(std::move(Err));
+        return;
+      }
+    }
+    From = JD;
+    if (!JD)
+      return;
+    SymbolAliasMap Alias;
+    Alias[Name] = SymbolAliasMapEntry(
+        Name, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    cantFail(ForwardJD.define(reexports(*JD, std::move(Alias))));
+  }
+
+  void rebuildSearchOrder() {
+    SearchOrder.clear();
+    for (auto *D : make_range(Dylibs.rbegin(), Dylibs.rend()))
+      SearchOrder.push_back({D, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    SearchOrder.push_back(
+        {&ProcessJD, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+  }
+
+  std::unique_ptr<ExecutionSession> ES;
+  JITTargetMachineBuilder JTMB;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
-  ObjLayerT ObjectLayer;
-  CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  MangleAndInterner Mangle;
+  unsigned OptLevel;
+  bool FunctionPassesOnly;
+  Stats *S;
+  ThreadTargetMachines ThreadTMs;
+  std::unique_ptr<ThreadPool> CompileThreads;
+  std::unique_ptr<DiskObjectCache> Cache;
+  RTDyldObjectLinkingLayer ObjectLayer;
+  IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+  JITDylib &ProcessJD;
+  JITDylib &ForwardJD; // see forward()
+
+  // lazy mode only
+  std::unique_ptr<LazyCallThroughManager> LCTMgr;
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
+  std::mutex DylibsMutex; // guards the seven below
+  std::vector<JITDylib *> Dylibs;
+  JITDylib *PrivateJD = nullptr; // see addPrivateModule()
+  JITDylibSearchOrder SearchOrder;
+  // how many modules define each symbol, and what each module defines
+  DenseMap<SymbolStringPtr, unsigned> Defined;
+  DenseMap<JITDylib *, SymbolNameVector> DefinedIn;
+  // the functions called before they were defined, and the module ForwardJD
+  // takes each from, null until there is one
+  DenseMap<SymbolStringPtr, JITDylib *> Forwarded;
+  unsigned NextId = 0;
 };
 
 } // end namespace orc
@@ -3,12 +3,198 @@
 
 #include <cstdlib>
 
+#include "llvm/Support/MathExtras.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace ast {
-int Lexer::get_tok() {
+namespace {
+// character classes used by the buffer scanner
+enum : unsigned char { cc_space = 1, cc_alpha = 2, cc_digit = 4 };
+
+struct CharTable {
+  unsigned char cls[256];
+
+  CharTable() {
+    for (int c = 0; c < 256; c++) {
+      cls[c] = 0;
+      if (c == ' ' || c == '\n' || c == '\t' || c == '\r')
+        cls[c] |= cc_space;
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        cls[c] |= cc_alpha;
+      if (c >= '0' && c <= '9')
+        cls[c] |= cc_digit;
+    }
+  }
+};
+
+const CharTable char_table;
+
+inline bool is_space(char c) {
+  return char_table.cls[(unsigned char)c] & cc_space;
+}
+
+inline bool is_alpha(char c) {
+  return char_table.cls[(unsigned char)c] & cc_alpha;
+}
+
+inline bool is_alnum(char c) {
+  return char_table.cls[(unsigned char)c] & (cc_alpha | cc_digit);
+}
+
+inline bool is_num(char c) {
+  return (char_table.cls[(unsigned char)c] & cc_digit) || c == '.';
+}
+
+// skips a run of whitespace, 16 bytes at a time where SSE2 is available
+const char *skip_space(const char *p, const char *end) {
+  // most runs are a single space, don't bother with vector loads for those
+  if (p == end || !is_space(*p))
+    return p;
+#if defined(__SSE2__)
+  const __m128i sp = _mm_set1_epi8(' '), nl = _mm_set1_epi8('\n'),
+                tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, sp), _mm_cmpeq_epi8(chunk, nl)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, tab), _mm_cmpeq_epi8(chunk, cr)));
+    unsigned rest = ~_mm_movemask_epi8(ws) & 0xFFFF;
+    if (rest)
+      return p + llvm::countTrailingZeros(rest);
+    p += 16;
+  }
+#endif
+  while (p != end && is_space(*p))
+    p++;
+  return p;
+}
+
+// skips a run of [a-zA-Z0-9], 16 bytes at a time where SSE2 is available
+const char *skip_alnum(const char *p, const char *end) {
+#if defined(__SSE2__)
+  // bytes >= 0x80 are negative as signed chars, so they fall out of every
+  // range below
+  const __m128i lo_a = _mm_set1_epi8('a' - 1), hi_a = _mm_set1_epi8('z' + 1),
+                lo_A = _mm_set1_epi8('A' - 1), hi_A = _mm_set1_epi8('Z' + 1),
+                lo_0 = _mm_set1_epi8('0' - 1), hi_0 = _mm_set1_epi8('9' + 1);
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i lower =
+        _mm_and_si128(_mm_cmpgt_epi8(c, lo_a), _mm_cmplt_epi8(c, hi_a));
+    __m128i upper =
+        _mm_and_si128(_mm_cmpgt_epi8(c, lo_A), _mm_cmplt_epi8(c, hi_A));
+    __m128i digit =
+        _mm_and_si128(_mm_cmpgt_epi8(c, lo_0), _mm_cmplt_epi8(c, hi_0));
+    __m128i alnum = _mm_or_si128(_mm_or_si128(lower, upper), digit);
+    unsigned rest = ~_mm_movemask_epi8(alnum) & 0xFFFF;
+    if (rest)
+      return p + llvm::countTrailingZeros(rest);
+    p += 16;
+  }
+#endif
+  while (p != end && is_alnum(*p))
+    p++;
+  return p;
+}
+
+// strtod needs a terminated string, numbers are short so copy onto the stack
+double parse_number(const char *begin, const char *end) {
+  char buf[64];
+  size_t len = end - begin;
+  if (len >= sizeof(buf))
+    return std::strtod(std::string(begin, len).c_str(), 0);
+  memcpy(buf, begin, len);
+  buf[len] = '\0';
+  return std::strtod(buf, 0);
+}
+} // namespace
+
+int Lexer::ident_tok(llvm::StringRef str) {
+  static const Symbol kw_def = Symbol::intern("def");
+  static const Symbol kw_extern = Symbol::intern("extern");
+  static const Symbol kw_if = Symbol::intern("if");
+  static const Symbol kw_then = Symbol::intern("then");
+  static const Symbol kw_else = Symbol::intern("else");
+  static const Symbol kw_for = Symbol::intern("for");
+  static const Symbol kw_in = Symbol::intern("in");
+  static const Symbol kw_var = Symbol::intern("var");
+
+  identifier = Symbol::intern(str);
+  if (identifier == kw_def) { // if the token is "def"
+    return tok_def;
+  } else if (identifier == kw_extern) { // if the token is "extern"
+    return tok_extern;
+  } else if (identifier == kw_if) {
+    return tok_if;
+  } else if (identifier == kw_then) {
+    return tok_then;
+  } else if (identifier == kw_else) {
+    return tok_else;
+  } else if (identifier == kw_for) {
+    return tok_for;
+  } else if (identifier == kw_in) {
+    return tok_in;
+  } else if (identifier == kw_var) {
+    return tok_var;
+  } else { // otherwise it's an identifier
+    return tok_identifier;
+  }
+}
+
+int Lexer::number_tok(llvm::StringRef str) {
+  if (str.count('.') > 1) {
+    log_error("a number cannot have more than one '.'");
+    return tok_error;
+  }
+  num_val = parse_number(str.begin(), str.end());
+  return tok_number;
+}
+
+int Lexer::get_tok() { return buffer ? get_tok_buffer() : get_tok_stream(); }
+
+int Lexer::get_tok_buffer() {
+  while (true) {
+    cur = skip_space(cur, end);
+
+    // end of file
+    if (cur == end)
+      return tok_eof;
+
+    const char *start = cur;
+
+    // if we get an alphabetic char, intern the slice of the buffer directly
+    if (is_alpha(*cur)) {
+      cur = skip_alnum(cur + 1, end);
+      return ident_tok(llvm::StringRef(start, cur - start));
+    }
+
+    // if we get a digit or '.'
+    if (is_num(*cur)) {
+      while (cur != end && is_num(*cur))
+        cur++;
+      return number_tok(llvm::StringRef(start, cur - start));
+    }
+
+    // comment until the end of this line, which may end in '\n' or '\r'
+    if (*cur == '#') {
+      size_t eol = llvm::StringRef(cur, end - cur).find_first_of("\n\r");
+      cur = eol == llvm::StringRef::npos ? end : cur + eol;
+      continue;
+    }
+
+    // otherwise return the ascii value
+    return (unsigned char)*cur++;
+  }
+}
+
+int Lexer::get_tok_stream() {
 
   // getting rid of whitespace
-  while (last_char == ' ' || last_char == '\n') {
-    last_char = input_stream.get();
+  while (last_char != EOF && isspace(last_char)) {
+    last_char = input_stream->get();
   }
 
   // if we get an alphabetic char
@@ -16,45 +202,30 @@ int Lexer::get_tok() {
     identifier_str = last_char;
 
     // get next char while it's alphanumeric
-    while (isalnum(last_char = input_stream.get())) {
+    while (isalnum(last_char = input_stream->get())) {
       identifier_str += last_char;
     }
 
-    if (identifier_str == "def") { // if the token is "def"
-      return tok_def;
-    } else if (identifier_str == "extern") { // if the token is "extern"
-      return tok_extern;
-    } else { // otherwise it's an identifier
-      return tok_identifier;
-    }
+    return ident_tok(identifier_str);
 
     // if we get a digit or '.'
   } else if (isdigit(last_char) || last_char == '.') {
-    int dot_count = 0;
-
     std::string num_str;
     while (isdigit(last_char) || last_char == '.') {
-      if (last_char == '.') {
-        dot_count++;
-      }
-
       num_str += last_char;
-      last_char = input_stream.get();
+      last_char = input_stream->get();
     }
 
-    // FIXME, if dot_count >= 2
-
-    num_val = std::strtod(num_str.c_str(), 0);
-    return tok_number;
+    return number_tok(num_str);
 
-    // comment until the end of this line
+    // comment until the end of this line, which may end in '\n' or '\r'
   } else if (last_char == '#') {
-    while (last_char != EOF || last_char != '\n' || last_char != '\r')
-      last_char = input_stream.get();
+    while (last_char != EOF && last_char != '\n' && last_char != '\r')
+      last_char = input_stream->get();
     if (last_char == EOF)
       return tok_eof;
     else
-      return Lexer::get_tok();
+      return Lexer::get_tok_stream();
 
     // end of file
   } else if (last_char == EOF) {
@@ -63,7 +234,7 @@ int Lexer::get_tok() {
     // otherwise return the ascii value
   } else {
     int ret_val = last_char;
-    last_char = input_stream.get();
+    last_char = input_stream->get();
     return ret_val;
   }
 }
@@ -76,8 +247,9 @@ int Lexer::get_tok() {
 //     while((token = lexer.get_tok()) != ast::tok_eof) {
 //         switch(token) {
 //             case ast::tok_identifier: std::cout << "identifier " <<
-//             lexer.get_identifier() << "\n"; break; case ast::tok_number:
-//             std::cout << "number " << lexer.get_num_val() << "\n";
+//             lexer.get_identifier().str().str() << "\n"; break; case
+//             ast::tok_number: std::cout << "number " << lexer.get_num_val()
+//             << "\n";
 //         }
 //     }
 // }
@@ -3,8 +3,14 @@
 
 #include <ctype.h>
 #include <iostream>
+#include <memory>
 #include <string.h>
 
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Symbol.hpp"
+
 namespace ast {
 enum Token {
   tok_eof = -1,
@@ -15,18 +21,51 @@ enum Token {
 
   // primary
   tok_identifier = -4,
-  tok_number = -5
+  tok_number = -5,
+
+  // control flow
+  tok_if = -6,
+  tok_then = -7,
+  tok_else = -8,
+  tok_for = -9,
+  tok_in = -10,
+
+  // variables
+  tok_var = -11,
+
+  // a malformed token, which the lexer has already reported
+  tok_error = -12
 };
 
+// The lexer runs in one of two modes:
+//  - stream mode pulls characters one at a time from an std::istream, which is
+//    what the interactive REPL needs
+//  - buffer mode scans a whole source buffer (usually a memory-mapped file)
+//    with pointers, and identifiers are interned straight from that buffer
 class Lexer {
-  std::string identifier_str; // Filled in if tok_identifier
+  std::string identifier_str; // scratch for identifiers in stream mode
+  Symbol identifier;          // Filled in if tok_identifier
   double num_val;             // Filled in if tok_number
-  std::istream &input_stream;
-  char last_char;
+
+  // stream mode
+  std::istream *input_stream;
+  int last_char;
+
+  // buffer mode
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  const char *cur;
+  const char *end;
 
 public:
   explicit Lexer(std::istream &in)
-      : num_val(0), last_char(' '), input_stream(in), identifier_str() {}
+      : num_val(0), input_stream(&in), last_char(' '), cur(nullptr),
+        end(nullptr) {}
+
+  // scan an in-memory buffer, the buffer is owned by the lexer
+  explicit Lexer(std::unique_ptr<llvm::MemoryBuffer> buf)
+      : num_val(0), input_stream(nullptr), last_char(' '),
+        buffer(std::move(buf)), cur(buffer->getBufferStart()),
+        end(buffer->getBufferEnd()) {}
 
   // the tokenizer
   // returns the next token found in the input stream
@@ -36,8 +75,19 @@ public:
   double get_num_val() { return num_val; }
 
   // the last identifier
-  std::string get_identifier() { return identifier_str; }
+  Symbol get_identifier() { return identifier; }
+
+private:
+  int get_tok_stream();
+  int get_tok_buffer();
+
+  // interns an identifier and classifies it as a keyword or tok_identifier
+  int ident_tok(llvm::StringRef str);
+
+  // converts the digits and dots of a number, tok_error if there is more
+  // than one dot
+  int number_tok(llvm::StringRef str);
 };
 } // namespace ast
 
-#endif // LEXER_HPP
\ No newline at end of file
+#endif // LEXER_HPP
@@ -1,9 +1,292 @@
 #include "Compiler.hpp"
+#include "Options.hpp"
 
 #include <iostream>
 
+#include "llvm/Support/CommandLine.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+
+namespace cl = llvm::cl;
+
+static cl::OptionCategory kc_category("kc options");
+
+static cl::opt<std::string> input_file(cl::Positional,
+                                       cl::desc("[source file]"),
+                                       cl::init(""), cl::cat(kc_category));
+
+static cl::opt<bool>
+    tiered("tiered",
+           cl::desc("Interpret top-level expressions and cold functions, JIT "
+                    "functions once they get hot"),
+           cl::cat(kc_category));
+
+static cl::opt<unsigned>
+    hot_threshold("hot-threshold",
+                  cl::desc("Calls before a function is JIT'd (--tiered) or "
+                           "optimized (--tiered-jit)"),
+                  cl::init(1000), cl::cat(kc_category));
+
+static cl::opt<bool> tiered_jit(
+    "tiered-jit",
+    cl::desc("JIT functions without optimizing them, and recompile them "
+             "optimized in the background once they get hot"),
+    cl::cat(kc_category));
+
+static cl::opt<bool>
+    lazy("lazy",
+         cl::desc("Compile each function to machine code on its first call"),
+         cl::cat(kc_category));
+
+static cl::opt<unsigned> compile_threads(
+    "compile-threads",
+    cl::desc("Compile modules on this many background threads (0: compile "
+             "on the REPL thread when a symbol is looked up)"),
+    cl::init(0), cl::cat(kc_category));
+
+static cl::opt<std::string>
+    cache_dir("cache-dir",
+              cl::desc("Keep compiled objects in this directory and reuse "
+                       "them in later sessions"),
+              cl::value_desc("dir"), cl::cat(kc_category));
+
+static cl::opt<bool>
+    cache_stats("cache-stats",
+                cl::desc("Print object cache hits and misses at exit"),
+                cl::cat(kc_category));
+
+static cl::opt<char>
+    opt_level("O",
+              cl::desc("Optimization level: -O0, -O1, -O2 or -O3 "
+                       "(default -O2, and in the REPL only function passes)"),
+              cl::Prefix, cl::init('2'), cl::cat(kc_category));
+
+static cl::opt<ast::Options::FPModel> fp_model(
+    "fp-model", cl::desc("Floating-point model"),
+    cl::values(clEnumValN(ast::Options::fp_strict, "strict",
+                          "IEEE arithmetic as written (default)"),
+               clEnumValN(ast::Options::fp_contract, "contract",
+                          "Also fuse multiplies and adds into FMAs"),
+               clEnumValN(ast::Options::fp_fast, "fast",
+                          "Any algebraic rewrite, no NaNs or infinities")),
+    cl::init(ast::Options::fp_strict), cl::cat(kc_category));
+
+static cl::opt<std::string>
+    cpu("mcpu",
+        cl::desc("CPU to generate code for (default: the host's, \"native\")"),
+        cl::value_desc("name"), cl::cat(kc_category));
+
+static cl::list<std::string>
+    cpu_features("mattr",
+                 cl::desc("CPU features to turn on or off, on top of the "
+                          "CPU's own (e.g. -mattr=+avx2,-avx512f)"),
+                 cl::value_desc("+feature,-feature,..."), cl::CommaSeparated,
+                 cl::cat(kc_category));
+
+static cl::opt<bool> whole_program(
+    "whole-program",
+    cl::desc("Link the bodies of called functions into every module before "
+             "optimizing it, so calls can be inlined across definitions"),
+    cl::cat(kc_category));
+
+static cl::opt<bool>
+    fold("fold",
+         cl::desc("Fold constants and evaluate closed expressions at compile "
+                  "time (default on, --fold=false to disable)"),
+         cl::init(true), cl::cat(kc_category));
+
+static cl::list<std::string>
+    memoize("memoize",
+            cl::desc("Cache the results of these pure functions in a table "
+                     "in front of their body"),
+            cl::value_desc("function,..."), cl::CommaSeparated,
+            cl::cat(kc_category));
+
+static cl::opt<unsigned>
+    memo_size("memo-size",
+              cl::desc("Entries in each memo table, rounded up to a power of "
+                       "two (default 1024)"),
+              cl::init(1024), cl::cat(kc_category));
+
+static cl::opt<bool>
+    memo_stats("memo-stats",
+               cl::desc("Count memo hits and misses and print them at exit"),
+               cl::cat(kc_category));
+
+static cl::opt<bool>
+    rebind("rebind",
+           cl::desc("On a redefinition, recompile every function that calls "
+                    "it, so compiled code always calls the newest definition"),
+           cl::cat(kc_category));
+
+static cl::opt<bool>
+    batch("batch",
+          cl::desc("Run a script: no prompts or IR dumps, and each run of "
+                   "top-level expressions is JIT'd as one module"),
+          cl::cat(kc_category));
+
+static cl::opt<ast::Options::StatsFormat> stats(
+    "compile-stats",
+    cl::desc("Time every phase and optimization pass, count the code "
+             "produced, and print it all at exit"),
+    cl::values(clEnumValN(ast::Options::stats_text, "text", "A table (default)"),
+               clEnumValN(ast::Options::stats_json, "json", "A JSON object"),
+               clEnumValN(ast::Options::stats_text, "", "")),
+    cl::ValueOptional, cl::init(ast::Options::stats_none),
+    cl::cat(kc_category));
+
+static cl::opt<ast::Options::ProfileMode> profile(
+    "profile",
+    cl::desc("Count the calls to every JIT'd function, and print the hottest "
+             "at exit"),
+    cl::values(clEnumValN(ast::Options::profile_calls, "calls",
+                          "Calls only (default)"),
+               clEnumValN(ast::Options::profile_cycles, "cycles",
+                          "Calls and timestamp-counter cycles"),
+               clEnumValN(ast::Options::profile_calls, "", "")),
+    cl::ValueOptional, cl::init(ast::Options::profile_none),
+    cl::cat(kc_category));
+
+static cl::opt<std::string>
+    profile_output("profile-out",
+                   cl::desc("Write the profile to this file as JSON"),
+                   cl::value_desc("file"), cl::cat(kc_category));
+
+static cl::opt<std::string>
+    profile_input("profile-use",
+                  cl::desc("Optimize with the counts of a profile written by "
+                           "--profile-out"),
+                  cl::value_desc("file"), cl::cat(kc_category));
+
+static cl::opt<ast::Options::Emit> emit(
+    "emit", cl::desc("Compile the whole input ahead of time instead of running it"),
+    cl::values(clEnumValN(ast::Options::emit_jit, "jit",
+                          "Run it in the JIT (default)"),
+               clEnumValN(ast::Options::emit_obj, "obj",
+                          "Write a native object file with a main()"),
+               clEnumValN(ast::Options::emit_exe, "exe",
+                          "Link a native executable")),
+    cl::init(ast::Options::emit_jit), cl::cat(kc_category));
+
+static cl::opt<std::string>
+    output("o",
+           cl::desc("Output file for --emit (default: a.out, or the source "
+                    "file with .o for objects)"),
+           cl::value_desc("file"), cl::cat(kc_category));
+
+// false with an error printed unless the host's target knows the CPU
+// options name; LLVM would only warn, again for every target machine. It has
+// no such check for features, unknown ones are warned about and ignored.
+static bool check_cpu(const ast::Options &options) {
+  if (options.cpu.empty() || options.cpu == "native")
+    return true;
+  llvm::InitializeNativeTarget();
+  std::string triple = llvm::sys::getProcessTriple(), err;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, err);
+  if (!target)
+    return true; // reported once the JIT is set up
+  std::unique_ptr<llvm::MCSubtargetInfo> info(
+      target->createMCSubtargetInfo(triple, "", ""));
+  if (!info->isCPUStringValid(options.cpu)) {
+    std::cerr << "Error: unknown CPU " << options.cpu << " for " << triple
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char *argv[]) {
-  ast::Compiler compiler(std::cin);
-  compiler.compile(); //acutally interpret!
-  return 0;
+  cl::HideUnrelatedOptions(kc_category);
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT compiler\n");
+
+  ast::Options options;
+  options.tiered = tiered;
+  options.hot_threshold = hot_threshold;
+  options.tiered_jit = tiered_jit;
+  options.lazy = lazy;
+  options.compile_threads = compile_threads;
+  options.cache_dir = cache_dir;
+  options.cache_stats = cache_stats;
+  if (opt_level < '0' || opt_level > '3') {
+    std::cerr << "Error: invalid optimization level -O" << opt_level
+              << std::endl;
+    return 1;
+  }
+  options.opt_level = opt_level - '0';
+  options.fp_model = fp_model;
+  options.cpu = cpu;
+  options.cpu_features.assign(cpu_features.begin(), cpu_features.end());
+  options.whole_program = whole_program;
+  options.fold = fold;
+  options.memoize.assign(memoize.begin(), memoize.end());
+  options.memo_size = memo_size;
+  options.memo_stats = memo_stats;
+  options.rebind = rebind;
+  options.batch = batch;
+  options.stats = stats;
+  options.profile = profile;
+  options.profile_output = profile_output;
+  options.profile_input = profile_input;
+  options.emit = emit;
+  options.output = output;
+  // one-line definitions typed into the REPL don't need the whole pipeline
+  options.function_passes_only = !opt_level.getNumOccurrences() &&
+                                 !options.batch && !options.aot() &&
+                                 !options.whole_program;
+
+  if (options.aot() && options.tiered) {
+    std::cerr << "Error: --tiered runs code in the JIT, it cannot be combined "
+                 "with --emit" << std::endl;
+    return 1;
+  }
+  if (options.tiered_jit && (options.tiered || options.lazy || options.aot())) {
+    std::cerr << "Error: --tiered-jit cannot be combined with --tiered, "
+                 "--lazy or --emit" << std::endl;
+    return 1;
+  }
+  if (options.aot() && options.profile != ast::Options::profile_none) {
+    std::cerr << "Error: --profile counts calls in the JIT, it cannot be "
+                 "combined with --emit" << std::endl;
+    return 1;
+  }
+  if (!options.profile_output.empty() &&
+      options.profile == ast::Options::profile_none) {
+    std::cerr << "Error: --profile-out needs --profile" << std::endl;
+    return 1;
+  }
+  if (!check_cpu(options))
+    return 1;
+  if (options.aot() && options.output.empty()) {
+    if (options.emit == ast::Options::emit_exe)
+      options.output = "a.out";
+    else if (input_file.empty())
+      options.output = "out.o";
+    else {
+      llvm::SmallString<128> obj(llvm::sys::path::filename(input_file));
+      llvm::sys::path::replace_extension(obj, "o");
+      options.output = obj.str().str();
+    }
+  }
+
+  // no source file, interactive REPL on stdin
+  if (input_file.empty()) {
+    ast::Compiler compiler(std::cin, options);
+    return compiler.compile() ? 0 : 1;
+  }
+
+  // otherwise map the source file and lex it in place
+  auto source = llvm::MemoryBuffer::getFile(input_file);
+  if (!source) {
+    std::cerr << "Error: cannot open " << input_file << ": "
+              << source.getError().message() << std::endl;
+    return 1;
+  }
+
+  ast::Compiler compiler(std::move(*source), options);
+  return compiler.compile() ? 0 : 1;
 }
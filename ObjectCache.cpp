@@ -0,0 +1,129 @@
+#include "ObjectCache.hpp"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+
+DiskObjectCache::DiskObjectCache(std::string dir, std::string target_key)
+    : dir(std::move(dir)), target_key(std::move(target_key)) {
+  if (auto err = llvm::sys::fs::create_directories(this->dir))
+    llvm::errs() << "Error: cannot create object cache " << this->dir << ": "
+                 << err.message() << "\n";
+}
+
+// whether c is, or refers to, an integer turned into a pointer
+static bool is_address(const llvm::Constant *c,
+                       llvm::SmallPtrSetImpl<const llvm::Constant *> &seen) {
+  auto *e = llvm::dyn_cast<llvm::ConstantExpr>(c);
+  if (!e || !seen.insert(e).second)
+    return false;
+  if (e->getOpcode() == llvm::Instruction::IntToPtr &&
+      llvm::isa<llvm::ConstantInt>(e->getOperand(0)))
+    return true;
+  for (auto &op : e->operands())
+    if (is_address(llvm::cast<llvm::Constant>(op), seen))
+      return true;
+  return false;
+}
+
+// memo tables, profile counters and tier state are baked into the code as
+// addresses, which differ from one run to the next
+static bool embeds_addresses(const llvm::Module &M) {
+  llvm::SmallPtrSet<const llvm::Constant *, 16> seen;
+  for (auto &f : M)
+    for (auto &inst : llvm::instructions(f))
+      for (auto &op : inst.operands())
+        if (auto *c = llvm::dyn_cast<llvm::Constant>(op))
+          if (is_address(c, seen))
+            return true;
+  return false;
+}
+
+std::string DiskObjectCache::cache_path(const llvm::Module &M) const {
+  // top-level expressions are thrown away right after they run, caching
+  // them would only fill the directory up
+  if (auto *f = M.getFunction("__anon_expr"))
+    if (!f->isDeclaration())
+      return std::string();
+
+  if (embeds_addresses(M))
+    return std::string();
+
+  std::string ir;
+  llvm::raw_string_ostream ir_stream(ir);
+  M.print(ir_stream, nullptr);
+  ir_stream.flush();
+
+  llvm::SHA1 hasher;
+  hasher.update(target_key);
+  hasher.update("\n");
+  hasher.update(ir);
+
+  llvm::SmallString<128> path(dir);
+  llvm::sys::path::append(path, llvm::toHex(hasher.result(), true) + ".o");
+  return path.str().str();
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+DiskObjectCache::getObject(const llvm::Module *M) {
+  auto path = cache_path(*M);
+  if (path.empty())
+    return nullptr;
+
+  auto obj = llvm::MemoryBuffer::getFile(path);
+  if (!obj) {
+    misses++;
+    // the object compiled next is for M: keep its path rather than hashing
+    // M's IR again
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    pending[M] = std::move(path);
+    return nullptr;
+  }
+
+  hits++;
+  bytes_read += (*obj)->getBufferSize();
+  return std::move(*obj);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module *M,
+                                           llvm::MemoryBufferRef obj) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    auto it = pending.find(M);
+    if (it == pending.end())
+      return;
+    path = std::move(it->second);
+    pending.erase(it);
+  }
+
+  // write to a temporary and rename it into place, so that concurrent
+  // compiles and concurrent kc processes never see half an object
+  int fd;
+  llvm::SmallString<128> tmp_path;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmp_path))
+    return;
+  {
+    llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+    out << obj.getBuffer();
+  }
+  if (llvm::sys::fs::rename(tmp_path, path)) {
+    llvm::sys::fs::remove(tmp_path);
+    return;
+  }
+  bytes_written += obj.getBufferSize();
+}
+
+void DiskObjectCache::print_stats(llvm::raw_ostream &out) const {
+  uint64_t lookups = hits + misses;
+  out << "object cache " << dir << ": " << hits << " hits, " << misses
+      << " misses";
+  if (lookups)
+    out << " (" << (100 * hits / lookups) << "% hit rate)";
+  out << ", " << bytes_read << " bytes read, " << bytes_written
+      << " bytes written\n";
+}
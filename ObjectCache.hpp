@@ -0,0 +1,49 @@
+#ifndef OBJECT_CACHE_HPP
+#define OBJECT_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// DiskObjectCache - keeps compiled objects in a directory across runs. An
+// object is keyed by a SHA1 of the module's optimized IR together with the
+// target triple, CPU and features, so an unchanged definition loads straight
+// from disk on the next start instead of going through the backend again.
+// Modules that embed addresses of this process (counters, tables) are never
+// cached. Safe to call from the JIT's compile threads.
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string dir;
+  std::string target_key; // triple, CPU and features
+
+  std::atomic<uint64_t> hits{0}, misses{0};
+  std::atomic<uint64_t> bytes_read{0}, bytes_written{0};
+
+  // paths of the modules that missed, until their objects are written
+  std::mutex pending_mutex;
+  llvm::DenseMap<const llvm::Module *, std::string> pending;
+
+public:
+  DiskObjectCache(std::string dir, std::string target_key);
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef obj) override;
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+  // hits, misses and bytes moved since the cache was created
+  void print_stats(llvm::raw_ostream &out) const;
+
+private:
+  // path of the object for M, empty if M shouldn't be cached
+  std::string cache_path(const llvm::Module &M) const;
+};
+
+#endif // OBJECT_CACHE_HPP
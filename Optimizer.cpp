@@ -0,0 +1,186 @@
+#include "Optimizer.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+
+// times every pass and analysis on its own; pass managers and adaptors only
+// run other passes
+static void instrument(llvm::PassInstrumentationCallbacks &PIC, Stats *stats) {
+  static const std::vector<llvm::StringRef> specials = {
+      "PassManager", "PassAdaptor", "AnalysisManagerProxy"};
+  auto timed = [](llvm::StringRef id) {
+    return !llvm::isSpecialPass(id, specials);
+  };
+
+  PIC.registerBeforeNonSkippedPassCallback(
+      [=](llvm::StringRef id, llvm::Any) {
+        if (timed(id))
+          stats->begin_pass();
+      });
+  PIC.registerAfterPassCallback(
+      [=](llvm::StringRef id, llvm::Any, const llvm::PreservedAnalyses &) {
+        if (timed(id))
+          stats->end_pass(id);
+      });
+  PIC.registerAfterPassInvalidatedCallback(
+      [=](llvm::StringRef id, const llvm::PreservedAnalyses &) {
+        if (timed(id))
+          stats->end_pass(id);
+      });
+  PIC.registerBeforeAnalysisCallback(
+      [=](llvm::StringRef, llvm::Any) { stats->begin_pass(); });
+  PIC.registerAfterAnalysisCallback(
+      [=](llvm::StringRef id, llvm::Any) { stats->end_pass(id); });
+}
+
+static void run_pipeline(llvm::Module &M, llvm::TargetMachine *TM,
+                         unsigned level, Stats *stats,
+                         bool function_passes_only) {
+  llvm::PassInstrumentationCallbacks PIC;
+  if (stats)
+    instrument(PIC, stats);
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  // what clang turns on at each level: unrolling from -O1, the loop and SLP
+  // vectorizers from -O2
+  llvm::PipelineTuningOptions PTO;
+  PTO.LoopUnrolling = level >= 1;
+  PTO.LoopInterleaving = level >= 1;
+  PTO.LoopVectorization = level >= 2;
+  PTO.SLPVectorization = level >= 2;
+
+  llvm::PassBuilder PB(TM, PTO, llvm::None, &PIC);
+  // the -O1 pipeline has no tail recursion elimination, which turns calls
+  // to the function itself into loops that the loop passes then see
+  if (level == 1)
+    PB.registerScalarOptimizerLateEPCallback(
+        [](llvm::FunctionPassManager &FPM, llvm::OptimizationLevel) {
+          FPM.addPass(llvm::TailCallElimPass());
+        });
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  if (level == 0) {
+    // variables live on the stack until they are promoted, which is cheap
+    // enough to do even here; like clang, -O0 still honours alwaysinline
+    llvm::ModulePassManager MPM;
+    MPM.addPass(llvm::AlwaysInlinerPass());
+    MPM.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::PromotePass()));
+    MPM.run(M, MAM);
+    return;
+  }
+
+  if (function_passes_only) {
+    llvm::ModulePassManager MPM;
+    MPM.addPass(llvm::createModuleToFunctionPassAdaptor(
+        PB.buildFunctionSimplificationPipeline(
+            llvm::OptimizationLevel::O1, llvm::ThinOrFullLTOPhase::None)));
+    MPM.run(M, MAM);
+    return;
+  }
+
+  static const llvm::OptimizationLevel levels[] = {
+      llvm::OptimizationLevel::O1, llvm::OptimizationLevel::O2,
+      llvm::OptimizationLevel::O3};
+  PB.buildPerModuleDefaultPipeline(levels[std::min(level, 3u) - 1]).run(M, MAM);
+}
+
+void optimize_module(llvm::Module &M, llvm::TargetMachine *TM, unsigned level,
+                     Stats *stats, bool function_passes_only) {
+  {
+    Stats::Timer timer(stats, Stats::optimize);
+    run_pipeline(M, TM, level, stats, function_passes_only);
+  }
+  if (!stats)
+    return;
+
+  stats->modules++;
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    stats->functions++;
+    stats->instructions += F.getInstructionCount();
+  }
+}
+
+static const char opt_level_flag[] = "kc.opt-level";
+
+void set_opt_level(llvm::Module &M, unsigned level) {
+  M.setModuleFlag(llvm::Module::Override, opt_level_flag,
+                  llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(
+                      llvm::Type::getInt32Ty(M.getContext()), level)));
+}
+
+unsigned get_opt_level(const llvm::Module &M, unsigned default_level) {
+  auto level = llvm::mdconst::extract_or_null<llvm::ConstantInt>(
+      M.getModuleFlag(opt_level_flag));
+  return level ? level->getZExtValue() : default_level;
+}
+
+llvm::FastMathFlags fast_math_flags(ast::Options::FPModel model) {
+  llvm::FastMathFlags flags;
+  if (model == ast::Options::fp_fast)
+    flags.setFast();
+  else if (model == ast::Options::fp_contract)
+    flags.setAllowContract();
+  return flags;
+}
+
+void set_fp_model(llvm::TargetOptions &options, ast::Options::FPModel model) {
+  bool fast = model == ast::Options::fp_fast;
+  options.AllowFPOpFusion = model == ast::Options::fp_strict
+                                ? llvm::FPOpFusion::Strict
+                                : llvm::FPOpFusion::Fast;
+  options.UnsafeFPMath = fast;
+  options.NoInfsFPMath = fast;
+  options.NoNaNsFPMath = fast;
+  options.NoSignedZerosFPMath = fast;
+  options.ApproxFuncFPMath = fast;
+}
+
+void set_fp_model(llvm::Function &F, ast::Options::FPModel model) {
+  if (model != ast::Options::fp_fast)
+    return;
+  for (auto attr : {"unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math",
+                    "no-signed-zeros-fp-math", "approx-func-fp-math"})
+    F.addFnAttr(attr, "true");
+}
+
+void select_cpu(std::string &cpu, llvm::SubtargetFeatures &features,
+                const std::string &cpu_name,
+                llvm::ArrayRef<std::string> cpu_features) {
+  if (!cpu_name.empty() && cpu_name != "native") {
+    cpu = cpu_name;
+    features = llvm::SubtargetFeatures();
+  }
+  // later ones win, so these override the CPU's own
+  for (auto &feature : cpu_features)
+    features.AddFeature(feature);
+}
+
+llvm::CodeGenOpt::Level codegen_opt_level(unsigned level) {
+  switch (level) {
+  case 0:
+    return llvm::CodeGenOpt::None;
+  case 1:
+    return llvm::CodeGenOpt::Less;
+  case 2:
+    return llvm::CodeGenOpt::Default;
+  default:
+    return llvm::CodeGenOpt::Aggressive;
+  }
+}
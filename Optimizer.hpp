@@ -0,0 +1,57 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include "Options.hpp"
+#include "Stats.hpp"
+
+// runs the new pass manager's default module pipeline for -O<level> over M:
+// function simplification, with SROA and mem2reg moving variables from the
+// stack to registers, tail recursion elimination, loop rotation, LICM and
+// unrolling, plus module passes such as inlining, IPSCCP and function
+// attribute inference; the loop and SLP vectorizers run from -O2. Level 0
+// runs nothing but mem2reg. With function_passes_only, a level above 0 runs
+// the -O1 function simplification passes alone, without inlining or any
+// other module pass. TM provides target cost information; it is not safe to
+// share between threads. With stats, the pipeline is timed pass by pass and
+// what comes out of it is counted.
+void optimize_module(llvm::Module &M, llvm::TargetMachine *TM, unsigned level,
+                     Stats *stats = nullptr,
+                     bool function_passes_only = false);
+
+// makes M ask for -O<level> instead of what its compiler does by default;
+// the JIT optimizes and compiles every module at the level it asks for
+void set_opt_level(llvm::Module &M, unsigned level);
+
+// the level M asks for, default_level if it doesn't
+unsigned get_opt_level(const llvm::Module &M, unsigned default_level);
+
+// backend optimization level matching -O<level>
+llvm::CodeGenOpt::Level codegen_opt_level(unsigned level);
+
+// the flags every floating-point instruction gets under model
+llvm::FastMathFlags fast_math_flags(ast::Options::FPModel model);
+
+// the backend's floating-point options for model: whether it may fuse a
+// multiply and an add, and under fp_fast what it may assume
+void set_fp_model(llvm::TargetOptions &options, ast::Options::FPModel model);
+
+// the same assumptions as function attributes, which is where the backend
+// reads them from for each function it compiles
+void set_fp_model(llvm::Function &F, ast::Options::FPModel model);
+
+// replaces the host's cpu and features, which they hold on entry, as
+// Options::cpu and Options::cpu_features describe: by cpu_name unless that is
+// empty or "native", and then by the features added to or taken from those
+void select_cpu(std::string &cpu, llvm::SubtargetFeatures &features,
+                const std::string &cpu_name,
+                llvm::ArrayRef<std::string> cpu_features);
+
+#endif // OPTIMIZER_HPP
@@ -0,0 +1,121 @@
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#include <string>
+#include <vector>
+
+namespace ast {
+// Options - settings shared by the Compiler and Codegen, filled in from the
+// command line by Main.cpp
+struct Options {
+  // what to do with the program: run it in the JIT, or compile the whole file
+  // ahead of time into an object or an executable written to output
+  enum Emit { emit_jit, emit_obj, emit_exe };
+  Emit emit = emit_jit;
+  std::string output;
+
+  // run top-level expressions and cold functions in the interpreter, and only
+  // JIT a function once it has been called hot_threshold times
+  bool tiered = false;
+  unsigned hot_threshold = 1000;
+
+  // JIT every function quickly, without optimizing it, behind a call
+  // counter; once it has been called hot_threshold times it is recompiled
+  // at opt_level in the background and its entry is patched to jump to the
+  // new code (not with tiered, lazy or concurrent)
+  bool tiered_jit = false;
+
+  // generate a function's machine code the first time it is called, instead
+  // of when its module is added to the JIT
+  bool lazy = false;
+
+  // threads the JIT compiles modules on in the background, 0 compiles on the
+  // calling thread when a symbol is looked up
+  unsigned compile_threads = 0;
+
+  // directory for the persistent object cache, empty to disable it; with
+  // cache_stats the hit/miss counts are printed when the session ends
+  std::string cache_dir;
+  bool cache_stats = false;
+
+  // -O level: the new pass manager's default pipeline, inlining and all,
+  // runs over every module before it is compiled
+  unsigned opt_level = 2;
+
+  // the REPL when no -O is given: modules only get the -O1 function
+  // simplification passes, no inlining or other module passes, which is all
+  // a one-line definition needs; the backend stays at -O<opt_level>
+  bool function_passes_only = false;
+
+  // floating-point model: strict IEEE arithmetic; contract, where a*b+c may
+  // become a fused multiply-add; or fast, where the optimizer may also
+  // reassociate (which vectorizes sums), and assume there are no NaNs,
+  // infinities or signed zeros
+  enum FPModel { fp_strict, fp_contract, fp_fast };
+  FPModel fp_model = fp_strict;
+
+  // CPU to generate code for, empty (or "native") for the host's, and
+  // features to turn on (+avx2 or just avx2) or off (-avx512f) on top of
+  // its own; naming a CPU drops the host's features
+  std::string cpu;
+  std::vector<std::string> cpu_features;
+
+  // copy the bodies of called functions into every module before it is
+  // optimized, so calls can be inlined across definitions (ignored in tiered
+  // mode)
+  bool whole_program = false;
+
+  // fold constants in the AST and evaluate closed expressions at compile
+  // time (see Folder)
+  bool fold = true;
+
+  // functions to memoize by name (pure ones only), the entries in each
+  // one's table, and whether to count hits and misses and print them at exit
+  std::vector<std::string> memoize;
+  unsigned memo_size = 1024;
+  bool memo_stats = false;
+
+  // script mode: no prompts or IR dumps, and instead of a module per item,
+  // definitions and a run of top-level expressions share one module that is
+  // JIT'd when the run ends (tiered mode still interprets them one by one)
+  bool batch = false;
+
+  // library sessions only (see Session): calls between functions go through
+  // a table of entry points that a redefinition swaps atomically, so other
+  // threads can keep calling while functions are replaced. Calls are bound
+  // late, so they are never folded, inlined or memoized.
+  bool concurrent = false;
+
+  // late binding by recompilation: a redefinition also regenerates every
+  // function that calls it, directly or through others, so that compiled
+  // code always calls the newest definitions, while functions that don't
+  // depend on it are left alone. Calls are not folded across definitions,
+  // and a function that is called keeps its arity. Concurrent mode binds
+  // late through its slots instead and ignores this.
+  bool rebind = false;
+
+  // time every phase and optimization pass and count the code produced (see
+  // Stats), and print the report at exit as text or JSON
+  enum StatsFormat { stats_none, stats_text, stats_json };
+  StatsFormat stats = stats_none;
+
+  // count the calls to every JIT'd function, or calls and timestamp-counter
+  // cycles (see Profile), and print the hottest functions at exit; with
+  // profile_output the whole profile is also written there. profile_input
+  // is a profile saved by an earlier run: its counts are handed to the
+  // optimizer, and functions it never saw called are optimized as cold.
+  enum ProfileMode { profile_none, profile_calls, profile_cycles };
+  ProfileMode profile = profile_none;
+  std::string profile_output;
+  std::string profile_input;
+
+  bool aot() const { return emit != emit_jit; }
+
+  bool rebinds() const { return rebind && !concurrent; }
+
+  // everything goes into one module until the input ends
+  bool single_module() const { return aot() || (batch && !tiered); }
+};
+} // namespace ast
+
+#endif // OPTIONS_HPP
@@ -0,0 +1,149 @@
+#include "Profile.hpp"
+
+#include <algorithm>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+Profile::Profile(const ast::FunctionTable &functions,
+                 const ast::Options &options)
+    : functions(functions),
+      counting(options.profile != ast::Options::profile_none &&
+               !options.aot()),
+      cycles(counting && options.profile == ast::Options::profile_cycles &&
+             !options.concurrent) {}
+
+Profile::Counters &Profile::get(unsigned id) {
+  // growing a deque at the end leaves the counters already handed out where
+  // they are
+  while (counters.size() <= id)
+    counters.emplace_back();
+  counters[id].used = true;
+  return counters[id];
+}
+
+std::vector<Profile::Entry> Profile::hot_functions() const {
+  std::vector<Entry> entries;
+  for (unsigned id = 0; id < counters.size(); id++) {
+    auto &c = counters[id];
+    if (!c.used)
+      continue;
+    auto &info = functions.get(id);
+    entries.push_back({info.name.str().str(),
+                       (unsigned)info.proto->get_args().size(),
+                       c.calls.load(std::memory_order_relaxed),
+                       c.cycles.load(std::memory_order_relaxed)});
+  }
+
+  bool by_cycles = cycles;
+  std::sort(entries.begin(), entries.end(),
+            [by_cycles](const Entry &a, const Entry &b) {
+              if (by_cycles && a.cycles != b.cycles)
+                return a.cycles > b.cycles;
+              if (a.calls != b.calls)
+                return a.calls > b.calls;
+              return a.name < b.name;
+            });
+  return entries;
+}
+
+void Profile::print(llvm::raw_ostream &out, unsigned limit) const {
+  auto entries = hot_functions();
+  uint64_t total_calls = 0, total_cycles = 0;
+  for (auto &e : entries) {
+    total_calls += e.calls;
+    total_cycles += e.cycles;
+  }
+
+  static const char *const header[] = {"function", "calls", "cycles",
+                                       "cycles/call", "%"};
+  if (cycles)
+    out << llvm::format("%-28s %14s %16s %12s %6s\n", header[0], header[1],
+                        header[2], header[3], header[4]);
+  else
+    out << llvm::format("%-28s %14s %6s\n", header[0], header[1], header[4]);
+
+  for (unsigned i = 0; i < entries.size() && i < limit; i++) {
+    auto &e = entries[i];
+    if (cycles)
+      out << llvm::format("%-28s %14llu %16llu %12.1f %6.1f\n",
+                          e.name.c_str(), (unsigned long long)e.calls,
+                          (unsigned long long)e.cycles,
+                          e.calls ? double(e.cycles) / e.calls : 0.0,
+                          total_cycles ? 100.0 * e.cycles / total_cycles : 0.0);
+    else
+      out << llvm::format("%-28s %14llu %6.1f\n", e.name.c_str(),
+                          (unsigned long long)e.calls,
+                          total_calls ? 100.0 * e.calls / total_calls : 0.0);
+  }
+  if (entries.size() > limit)
+    out << "(" << entries.size() - limit << " more)\n";
+}
+
+bool Profile::save(const std::string &path) const {
+  std::error_code err;
+  llvm::raw_fd_ostream out(path, err, llvm::sys::fs::OF_Text);
+  if (err) {
+    llvm::errs() << "Error: cannot write profile " << path << ": "
+                 << err.message() << "\n";
+    return false;
+  }
+
+  llvm::json::OStream json(out, 2);
+  json.object([&] {
+    json.attribute("cycles", cycles);
+    json.attributeArray("functions", [&] {
+      for (auto &e : hot_functions())
+        json.object([&] {
+          json.attribute("name", e.name);
+          json.attribute("arity", int64_t(e.arity));
+          json.attribute("calls", int64_t(e.calls));
+          if (cycles)
+            json.attribute("cycles", int64_t(e.cycles));
+        });
+    });
+  });
+  out << "\n";
+  return true;
+}
+
+bool Profile::load(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << "Error: cannot open profile " << path << ": "
+                 << buffer.getError().message() << "\n";
+    return false;
+  }
+
+  auto value = llvm::json::parse((*buffer)->getBuffer());
+  if (!value) {
+    llvm::errs() << "Error: invalid profile " << path << ": "
+                 << llvm::toString(value.takeError()) << "\n";
+    return false;
+  }
+
+  auto *root = value->getAsObject();
+  auto *list = root ? root->getArray("functions") : nullptr;
+  if (!list) {
+    llvm::errs() << "Error: invalid profile " << path
+                 << ": no functions array\n";
+    return false;
+  }
+  for (auto &item : *list) {
+    auto *fn = item.getAsObject();
+    auto name = fn ? fn->getString("name") : llvm::None;
+    auto calls = fn ? fn->getInteger("calls") : llvm::None;
+    if (name && calls && *calls >= 0)
+      recorded[*name] = *calls;
+  }
+  return true;
+}
+
+llvm::Optional<uint64_t> Profile::recorded_calls(llvm::StringRef name) const {
+  auto it = recorded.find(name);
+  if (it == recorded.end())
+    return llvm::None;
+  return it->second;
+}
@@ -0,0 +1,82 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "FunctionTable.hpp"
+#include "Options.hpp"
+
+// Profile - how often every JIT'd function was called and, optionally, the
+// timestamp-counter cycles spent in it, counted by the code itself (see
+// Codegen::instrument()). Counts are kept by function id, so they add up
+// over redefinitions. A profile saved by one session can be loaded by a
+// later one, whose optimizer then knows which functions are hot.
+class Profile {
+public:
+  // updated by JIT'd code with atomic adds, so they can be read while it
+  // runs; cycles are inclusive of callees and only counted for the outermost
+  // activation, so recursion isn't counted twice. depth is shared by all
+  // threads, which would count each other's calls as recursive: cycles are
+  // not counted in concurrent mode.
+  struct Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> depth{0}; // activations running
+    bool used = false;  // some code counts here
+  };
+
+  struct Entry {
+    std::string name;
+    unsigned arity;
+    uint64_t calls, cycles;
+  };
+
+private:
+  const ast::FunctionTable &functions;
+  bool counting, cycles;
+
+  std::deque<Counters> counters; // by function id, addresses are in JIT'd code
+
+  // calls by function name, from load()
+  llvm::StringMap<uint64_t> recorded;
+
+public:
+  // counts calls (and cycles) as options.profile asks; nothing is counted
+  // ahead of time, and cycles are not counted in concurrent mode, where
+  // activations from several threads overlap
+  Profile(const ast::FunctionTable &functions, const ast::Options &options);
+
+  bool counts_calls() const { return counting; }
+  bool counts_cycles() const { return cycles; }
+
+  // the counters of id, for JIT'd code to update
+  Counters &get(unsigned id);
+
+  // every function some code counts for, hottest first: by cycles if they
+  // are counted, otherwise by calls
+  std::vector<Entry> hot_functions() const;
+
+  // the limit hottest functions as a table
+  void print(llvm::raw_ostream &out, unsigned limit = 20) const;
+
+  // writes every function's counts to path as JSON, the format load() reads;
+  // false with an error printed on failure
+  bool save(const std::string &path) const;
+
+  // reads a profile written by save(); false with an error printed on failure
+  bool load(const std::string &path);
+
+  // calls to name in the loaded profile, none if it wasn't there
+  llvm::Optional<uint64_t> recorded_calls(llvm::StringRef name) const;
+};
+
+#endif // PROFILE_HPP
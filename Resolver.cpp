@@ -0,0 +1,138 @@
+#include "Resolver.hpp"
+#include "Error.hpp"
+
+#include <algorithm>
+
+#include "llvm/Support/Casting.h"
+
+namespace ast {
+bool Resolver::declare(PrototypeAST *proto) {
+  int id = functions.lookup(proto->get_name());
+  if (fixed_arity && id >= 0 &&
+      (functions.get(id).def || !functions.get(id).callers.empty()) &&
+      functions.get(id).proto->get_args().size() != proto->get_args().size()) {
+    log_error("cannot change the number of arguments of a function that is "
+              "defined or called");
+    return false;
+  }
+
+  functions.declare(proto);
+  return true;
+}
+
+bool Resolver::resolve(PrototypeAST *proto) { return declare(proto); }
+
+bool Resolver::resolve(FunctionAST *fn) {
+  // declared before the body so that it can call itself
+  auto proto = fn->get_proto();
+  if (!declare(proto))
+    return false;
+
+  scope.assign(proto->get_args().begin(), proto->get_args().end());
+  frame_size = scope.size();
+  callees.clear();
+  if (!resolve(fn->get_body()))
+    return false;
+  fn->set_frame_size(frame_size);
+  return true;
+}
+
+bool Resolver::resolve(ExprAST *expr) {
+  switch (expr->get_kind()) {
+  case ExprAST::expr_number:
+    return true;
+
+  case ExprAST::expr_variable: {
+    auto var = llvm::cast<VariableExprAST>(expr);
+    // innermost binding wins
+    for (unsigned i = scope.size(); i-- > 0;) {
+      if (scope[i] == var->get_name()) {
+        var->set_slot(i);
+        return true;
+      }
+    }
+    log_error("Unknown variable name");
+    return false;
+  }
+
+  case ExprAST::expr_binary: {
+    auto bin = llvm::cast<BinaryExprAST>(expr);
+    return resolve(bin->get_lhs()) && resolve(bin->get_rhs());
+  }
+
+  case ExprAST::expr_call: {
+    auto call = llvm::cast<CallExprAST>(expr);
+    int id = functions.lookup(call->get_callee());
+    if (id < 0) {
+      log_error("Unknown function");
+      return false;
+    }
+
+    if (functions.get(id).proto->get_args().size() != call->get_args().size()) {
+      log_error("Incorrect # arguments");
+      return false;
+    }
+
+    call->set_callee_id(id);
+    if (std::find(callees.begin(), callees.end(), (unsigned)id) == callees.end())
+      callees.push_back(id);
+    for (auto arg : call->get_args())
+      if (!resolve(arg))
+        return false;
+    return true;
+  }
+
+  case ExprAST::expr_if: {
+    auto node = llvm::cast<IfExprAST>(expr);
+    return resolve(node->get_cond()) && resolve(node->get_then()) &&
+           resolve(node->get_else());
+  }
+
+  case ExprAST::expr_for: {
+    auto node = llvm::cast<ForExprAST>(expr);
+    // the start value is outside the loop variable's scope
+    if (!resolve(node->get_start()))
+      return false;
+
+    node->set_slot(scope.size());
+    scope.push_back(node->get_var());
+    loops.push_back(node);
+    frame_size = std::max(frame_size, (unsigned)scope.size());
+    bool ok = resolve(node->get_end()) &&
+              (!node->get_step() || resolve(node->get_step())) &&
+              resolve(node->get_body());
+    loops.pop_back();
+    scope.pop_back();
+    return ok;
+  }
+
+  case ExprAST::expr_var: {
+    auto node = llvm::cast<VarExprAST>(expr);
+    // each initial value only sees the names before it
+    unsigned outer = scope.size();
+    node->set_slot(outer);
+    bool ok = true;
+    for (unsigned i = 0; ok && i < node->get_names().size(); i++) {
+      auto init = node->get_inits()[i];
+      ok = !init || resolve(init);
+      scope.push_back(node->get_names()[i]);
+    }
+    frame_size = std::max(frame_size, (unsigned)scope.size());
+    ok = ok && resolve(node->get_body());
+    scope.resize(outer);
+    return ok;
+  }
+
+  case ExprAST::expr_assign: {
+    auto node = llvm::cast<AssignExprAST>(expr);
+    if (!resolve(node->get_var()))
+      return false;
+    for (auto loop : loops)
+      if (loop->get_slot() == node->get_var()->get_slot())
+        loop->set_assigned();
+    return resolve(node->get_value());
+  }
+  }
+  return false;
+}
+} // namespace ast
@@ -0,0 +1,57 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+
+#include "AST.hpp"
+#include "FunctionTable.hpp"
+#include "Symbol.hpp"
+
+namespace ast {
+// Resolver - runs between the parser and Codegen. It binds every variable
+// reference to a variable slot and every callee to a function id, and
+// reports unknown names and arity mismatches, so that Codegen never has to
+// look anything up by name.
+class Resolver {
+  FunctionTable &functions;
+
+  // argument names of the function being resolved, then the loop and var
+  // variables in scope, innermost last; the index is the slot
+  llvm::SmallVector<Symbol, 8> scope;
+  unsigned frame_size; // most slots in use at once
+
+  // the for loops whose variables are in scope, innermost last
+  llvm::SmallVector<ForExprAST *, 4> loops;
+
+  // distinct function ids called by the function being resolved
+  std::vector<unsigned> callees;
+
+  // a function that is defined or called keeps its arity, for concurrent
+  // mode where code on other threads may call whatever definition is
+  // current, and for rebinding, where its callers are generated again
+  bool fixed_arity;
+
+public:
+  explicit Resolver(FunctionTable &functions, bool fixed_arity = false)
+      : functions(functions), frame_size(0), fixed_arity(fixed_arity) {}
+
+  // declares the function and resolves its body, false on error
+  bool resolve(FunctionAST *fn);
+
+  // declares an extern
+  bool resolve(PrototypeAST *proto);
+
+  // the functions called by the last function resolved
+  const std::vector<unsigned> &get_callees() const { return callees; }
+
+private:
+  bool resolve(ExprAST *expr);
+
+  // declares proto, false if it would change the arity of a fixed function
+  bool declare(PrototypeAST *proto);
+};
+} // namespace ast
+
+#endif // RESOLVER_HPP
@@ -0,0 +1,168 @@
+#include "Session.hpp"
+
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace ast {
+
+// batch mode without the batch: no prompts, IR dumps or printed values, and
+// one module per add(). No tiers: tier_up() generates code on the thread
+// that calls, which could be running alongside add()
+static Options library_options(Options options) {
+  options.batch = true;
+  options.tiered = false;
+  options.tiered_jit = false;
+  options.emit = Options::emit_jit;
+  return options;
+}
+
+Session::Session(const Options &options)
+    : compiler(library_options(options)), concurrent(options.concurrent) {}
+
+bool Session::add(llvm::StringRef source, ModuleId *module) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ModuleEntry entry;
+  bool ok = compiler.add_source(
+      llvm::MemoryBuffer::getMemBuffer(source, "<source>", false), entry.key,
+      entry.defined);
+
+  ModuleId id = modules.size();
+  modules.push_back(std::move(entry));
+  if (module)
+    *module = id;
+  if (concurrent)
+    ok &= publish(id);
+  return ok;
+}
+
+bool Session::compile(ModuleId module) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &entry = modules[module];
+  if (!entry.key)
+    return false;
+
+  // looking a symbol up materializes it
+  bool ok = true;
+  for (unsigned id : entry.defined)
+    ok &= compiler.get_codegen().get_address(id) != nullptr;
+  return ok;
+}
+
+void Session::free(ModuleId module) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (concurrent) {
+    epochs.collect();
+    return;
+  }
+
+  auto &entry = modules[module];
+  if (!entry.key)
+    return;
+  auto &codegen = compiler.get_codegen();
+  for (unsigned id : entry.defined)
+    codegen.free_batch_function(id);
+  codegen.remove_module(entry.key);
+  entry.key = nullptr;
+  entry.defined.clear();
+}
+
+bool Session::publish(ModuleId module) {
+  auto &codegen = compiler.get_codegen();
+  for (unsigned id : modules[module].defined)
+    if (id >= owners.size())
+      owners.resize(id + 1, -1);
+
+  // functions that are new go first, so that no code that is already
+  // reachable can call into an empty slot
+  bool ok = true;
+  for (bool fresh : {true, false}) {
+    for (unsigned id : modules[module].defined) {
+      int owner = owners[id];
+      if ((owner < 0) != fresh)
+        continue;
+      if (!codegen.publish(id)) {
+        ok = false;
+        continue;
+      }
+      owners[id] = module;
+      modules[module].live++;
+      if (owner >= 0 && --modules[owner].live == 0)
+        retire(owner);
+    }
+  }
+
+  epochs.collect();
+  return ok;
+}
+
+void Session::retire(ModuleId module) {
+  auto &entry = modules[module];
+  auto key = entry.key;
+  entry.key = nullptr;
+  entry.defined.clear();
+  epochs.retire(
+      [this, key]() { compiler.get_codegen().remove_module(key); });
+}
+
+int Session::lookup(llvm::StringRef name, unsigned arity) {
+  auto &functions = compiler.get_functions();
+  int id = functions.lookup(Symbol::intern(name));
+  if (id < 0 || functions.get(id).proto->get_args().size() != arity)
+    return -1;
+  return id;
+}
+
+void *Session::get_address(llvm::StringRef name, unsigned arity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  int id = lookup(name, arity);
+  return id < 0 ? nullptr : compiler.get_codegen().get_address(id);
+}
+
+const std::atomic<void *> *Session::get_slot(llvm::StringRef name,
+                                             unsigned arity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  int id = lookup(name, arity);
+  return id < 0 ? nullptr : compiler.get_codegen().get_slot(id);
+}
+
+void Session::print_stats(llvm::raw_ostream &out, bool json) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (auto stats = compiler.get_stats()) {
+    if (json)
+      stats->print_json(out);
+    else
+      stats->print(out);
+  }
+}
+
+std::vector<Profile::Entry> Session::hot_functions() {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto profile = compiler.get_profile();
+  if (!profile || !profile->counts_calls())
+    return {};
+  return profile->hot_functions();
+}
+
+void Session::print_profile(llvm::raw_ostream &out, unsigned limit) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto profile = compiler.get_profile();
+  if (profile && profile->counts_calls())
+    profile->print(out, limit);
+}
+
+bool Session::save_profile(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto profile = compiler.get_profile();
+  return profile && profile->counts_calls() && profile->save(path);
+}
+
+Codegen::BatchFunction Session::get_batch(llvm::StringRef name,
+                                          unsigned arity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &codegen = compiler.get_codegen();
+  // a freed definition has no code left to wrap
+  int id = lookup(name, arity);
+  if (id < 0 || !codegen.get_address(id))
+    return nullptr;
+  return codegen.get_batch_function(id);
+}
+} // namespace ast
@@ -0,0 +1,187 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "Codegen.hpp"
+#include "Compiler.hpp"
+#include "Epoch.hpp"
+#include "KaleidoscopeJIT.h"
+#include "Options.hpp"
+#include "Profile.hpp"
+
+namespace ast {
+template <typename... Args> struct all_double : std::true_type {};
+template <typename... Rest>
+struct all_double<double, Rest...> : all_double<Rest...> {};
+template <typename T, typename... Rest>
+struct all_double<T, Rest...> : std::false_type {};
+
+// Function - a typed handle to a JIT'd function. It holds the entry point, so
+// a call is a plain indirect call with no symbol lookup. Every Kaleidoscope
+// function takes and returns doubles, so Sig is double(double, ...).
+template <typename Sig> class Function;
+
+template <typename... Args> class Function<double(Args...)> {
+  static_assert(all_double<Args...>::value,
+                "Kaleidoscope functions only take doubles");
+
+  double (*addr)(Args...) = nullptr;
+
+public:
+  static constexpr unsigned arity = sizeof...(Args);
+
+  Function() = default;
+  explicit Function(void *addr)
+      : addr(reinterpret_cast<double (*)(Args...)>(addr)) {}
+
+  // false if the function wasn't found
+  explicit operator bool() const { return addr != nullptr; }
+
+  double operator()(Args... args) const { return addr(args...); }
+};
+
+// SharedFunction - a handle for concurrent mode, callable from any thread
+// while the function is being redefined. Every call runs whatever definition
+// is current when it starts, and pins an epoch so that the code it runs, and
+// the code that calls from there, isn't freed under it. A call never waits
+// for the compiler.
+template <typename Sig> class SharedFunction;
+
+template <typename... Args> class SharedFunction<double(Args...)> {
+  static_assert(all_double<Args...>::value,
+                "Kaleidoscope functions only take doubles");
+
+  const std::atomic<void *> *slot = nullptr;
+  EpochManager *epochs = nullptr;
+
+public:
+  static constexpr unsigned arity = sizeof...(Args);
+
+  SharedFunction() = default;
+  SharedFunction(const std::atomic<void *> *slot, EpochManager *epochs)
+      : slot(slot), epochs(epochs) {}
+
+  // false if the function wasn't found
+  explicit operator bool() const { return slot != nullptr; }
+
+  double operator()(Args... args) const {
+    auto guard = epochs->pin();
+    auto addr = slot->load(std::memory_order_acquire);
+    return reinterpret_cast<double (*)(Args...)>(addr)(args...);
+  }
+};
+
+// Session - the compiler as a library. Source text is compiled one module per
+// add(); get() returns handles that stay valid until their module is freed.
+// Machine code is generated when a function is first looked up (or in the
+// background with compile threads) unless compile() asks for it earlier.
+// Errors are reported on stderr. Calls that change the session are
+// serialized, handles can be called from any thread.
+//
+// A later add() may redefine a function: get() then returns the new
+// definition, while handles and code from before keep calling the old one.
+//
+// In concurrent mode (Options::concurrent) every call between functions,
+// and every call through a SharedFunction from get_shared(), goes to the
+// current definition instead. add() compiles the module right away and then
+// swaps the new entry points in; a module is freed by itself once all of its
+// functions have been redefined and no call that might be running its code
+// is left.
+class Session {
+public:
+  using ModuleId = unsigned;
+
+private:
+  struct ModuleEntry {
+    llvm::orc::KaleidoscopeJIT::ModuleKey key; // null once freed
+    std::vector<unsigned> defined;             // function ids
+    unsigned live = 0; // concurrent mode: functions whose slot points here
+  };
+
+  Compiler compiler;
+  std::vector<ModuleEntry> modules; // indexed by ModuleId
+  std::mutex mutex;
+
+  // concurrent mode: the module each function's slot points into, by
+  // function id (-1 if none yet), and what keeps retired modules alive
+  bool concurrent;
+  std::vector<int> owners;
+  EpochManager epochs;
+
+public:
+  // tiered modes (--tiered and --tiered-jit) and --emit don't apply to a
+  // library session and are ignored
+  explicit Session(const Options &options = Options());
+
+  // compiles the definitions and externs in source into a new module; items
+  // with errors are left out. False if there were any, or if source has
+  // top-level expressions. The id of the module goes to module if given.
+  bool add(llvm::StringRef source, ModuleId *module = nullptr);
+
+  // generates machine code for every function module defines now rather
+  // than on first use; false if some of it failed
+  bool compile(ModuleId module);
+
+  // frees the machine code of module. Handles to its functions, and code
+  // from later modules that calls them, must not be used afterwards. In
+  // concurrent mode modules free themselves, this only collects the ones no
+  // call is running anymore.
+  void free(ModuleId module);
+
+  // handle to the newest definition of name, empty if there is none or it
+  // doesn't take Function<Sig>::arity arguments; externs resolve to the host
+  // process
+  template <typename Sig> Function<Sig> get(llvm::StringRef name) {
+    return Function<Sig>(get_address(name, Function<Sig>::arity));
+  }
+
+  // concurrent mode: handle to whatever definition of name is current at
+  // each call, empty as for get(). A Function from get() runs the definition
+  // that was current when it was taken, and only until that one is replaced.
+  template <typename Sig> SharedFunction<Sig> get_shared(llvm::StringRef name) {
+    return SharedFunction<Sig>(get_slot(name, SharedFunction<Sig>::arity),
+                               &epochs);
+  }
+
+  // the timing and counter report so far, as text or JSON; nothing unless
+  // Options::stats was set
+  void print_stats(llvm::raw_ostream &out, bool json = false);
+
+  // profiling (Options::profile): every function called so far, hottest
+  // first, and the same as a table of the limit hottest or saved as JSON for
+  // Options::profile_input; empty, nothing or false if profiling is off.
+  // Counts of calls still running may be a little behind.
+  std::vector<Profile::Entry> hot_functions();
+  void print_profile(llvm::raw_ostream &out, unsigned limit = 20);
+  bool save_profile(const std::string &path);
+
+  // name mapped over arity columns of arguments, see
+  // Codegen::get_batch_function(); null as for get(), and in concurrent mode.
+  // Valid until the module of the definition is freed.
+  Codegen::BatchFunction get_batch(llvm::StringRef name, unsigned arity);
+
+private:
+  // id of name, -1 unless it is declared with arity arguments
+  int lookup(llvm::StringRef name, unsigned arity);
+
+  void *get_address(llvm::StringRef name, unsigned arity);
+
+  const std::atomic<void *> *get_slot(llvm::StringRef name, unsigned arity);
+
+  // concurrent mode: points the slots of everything module defines at its
+  // code, and retires the modules that no longer own any slot
+  bool publish(ModuleId module);
+
+  // concurrent mode: the machine code of module is freed once no call can
+  // be running it anymore
+  void retire(ModuleId module);
+};
+} // namespace ast
+
+#endif // SESSION_HPP
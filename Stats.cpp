@@ -0,0 +1,185 @@
+#include "Stats.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <time.h>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+static const char *const phase_names[] = {
+    "lex", "parse", "resolve", "fold", "codegen", "optimize", "emit", "execute"};
+
+static uint64_t wall_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t cpu_now() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// innermost timer running on this thread
+static thread_local Stats::Timer *active_timer = nullptr;
+
+// passes running on this thread, innermost last: time accumulated while
+// innermost, and when that last started
+struct PassSpan {
+  uint64_t wall, cpu, wall_start, cpu_start;
+};
+static thread_local std::vector<PassSpan> active_passes;
+
+Stats::Timer::Timer(Stats *stats, Phase phase)
+    : stats(stats), phase(phase), parent(nullptr), wall(0), cpu(0),
+      shared_phase(phase), shared_wall(0), shared_count(0) {
+  if (!stats)
+    return;
+  wall_start = wall_now();
+  cpu_start = cpu_now();
+  parent = active_timer;
+  if (parent) {
+    parent->wall += wall_start - parent->wall_start;
+    parent->cpu += cpu_start - parent->cpu_start;
+  }
+  active_timer = this;
+}
+
+Stats::Timer::~Timer() {
+  if (!stats)
+    return;
+  uint64_t wall_end = wall_now(), cpu_end = cpu_now();
+  uint64_t own_wall = wall + wall_end - wall_start;
+  uint64_t own_cpu = cpu + cpu_end - cpu_start;
+  uint64_t part_wall = std::min(shared_wall, own_wall);
+  uint64_t part_cpu =
+      own_wall ? uint64_t(double(own_cpu) * part_wall / own_wall) : 0;
+  {
+    std::lock_guard<std::mutex> lock(stats->mutex);
+    add(stats->phases[phase], own_wall - part_wall, own_cpu - part_cpu);
+    if (shared_count)
+      add(stats->phases[shared_phase], part_wall, part_cpu, shared_count);
+  }
+  active_timer = parent;
+  if (parent) {
+    parent->wall_start = wall_end;
+    parent->cpu_start = cpu_end;
+  }
+}
+
+void Stats::Timer::share(Phase other, uint64_t wall, uint64_t count) {
+  shared_phase = other;
+  shared_wall += wall;
+  shared_count += count;
+}
+
+void Stats::add(Time &time, uint64_t wall, uint64_t cpu, uint64_t count) {
+  time.wall += wall;
+  time.cpu += cpu;
+  time.count += count;
+}
+
+void Stats::begin_pass() {
+  uint64_t wall = wall_now(), cpu = cpu_now();
+  if (!active_passes.empty()) {
+    auto &parent = active_passes.back();
+    parent.wall += wall - parent.wall_start;
+    parent.cpu += cpu - parent.cpu_start;
+  }
+  active_passes.push_back({0, 0, wall, cpu});
+}
+
+void Stats::end_pass(llvm::StringRef name) {
+  uint64_t wall = wall_now(), cpu = cpu_now();
+  auto span = active_passes.back();
+  active_passes.pop_back();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    add(passes[name], span.wall + wall - span.wall_start,
+        span.cpu + cpu - span.cpu_start);
+  }
+  if (!active_passes.empty()) {
+    active_passes.back().wall_start = wall;
+    active_passes.back().cpu_start = cpu;
+  }
+}
+
+static double ms(uint64_t ns) { return ns / 1e6; }
+
+void Stats::print(llvm::raw_ostream &out) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  static const char *const phase_header[] = {"phase", "wall ms", "cpu ms",
+                                             "count"};
+  out << llvm::format("%-28s %12s %12s %10s\n", phase_header[0],
+                      phase_header[1], phase_header[2], phase_header[3]);
+  for (unsigned p = 0; p < num_phases; p++)
+    out << llvm::format("%-28s %12.3f %12.3f %10llu\n", phase_names[p],
+                        ms(phases[p].wall), ms(phases[p].cpu),
+                        (unsigned long long)phases[p].count);
+
+  if (!passes.empty()) {
+    // slowest first
+    std::vector<const llvm::StringMapEntry<Time> *> sorted;
+    for (auto &pass : passes)
+      sorted.push_back(&pass);
+    std::sort(sorted.begin(), sorted.end(), [](auto *a, auto *b) {
+      return a->getValue().wall > b->getValue().wall;
+    });
+
+    static const char *const pass_header[] = {"pass", "wall ms", "cpu ms",
+                                              "runs"};
+    out << llvm::format("\n%-28s %12s %12s %10s\n", pass_header[0],
+                        pass_header[1], pass_header[2], pass_header[3]);
+    for (auto *pass : sorted)
+      out << llvm::format("%-28s %12.3f %12.3f %10llu\n",
+                          pass->getKey().str().c_str(),
+                          ms(pass->getValue().wall), ms(pass->getValue().cpu),
+                          (unsigned long long)pass->getValue().count);
+  }
+
+  out << "\nmodules " << modules << ", functions " << functions
+      << ", instructions " << instructions << "\n"
+      << "object bytes " << object_bytes << ", code bytes " << code_bytes
+      << ", JIT memory " << jit_memory << " bytes\n";
+}
+
+void Stats::print_json(llvm::raw_ostream &out) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  llvm::json::OStream json(out, 2);
+  auto time = [&](const Time &t) {
+    json.object([&] {
+      json.attribute("wall_ns", int64_t(t.wall));
+      json.attribute("cpu_ns", int64_t(t.cpu));
+      json.attribute("count", int64_t(t.count));
+    });
+  };
+
+  json.object([&] {
+    json.attributeObject("phases", [&] {
+      for (unsigned p = 0; p < num_phases; p++) {
+        json.attributeBegin(phase_names[p]);
+        time(phases[p]);
+        json.attributeEnd();
+      }
+    });
+    json.attributeObject("passes", [&] {
+      for (auto &pass : passes) {
+        json.attributeBegin(pass.getKey());
+        time(pass.getValue());
+        json.attributeEnd();
+      }
+    });
+    json.attributeObject("counters", [&] {
+      json.attribute("modules", int64_t(modules));
+      json.attribute("functions", int64_t(functions));
+      json.attribute("instructions", int64_t(instructions));
+      json.attribute("object_bytes", int64_t(object_bytes));
+      json.attribute("code_bytes", int64_t(code_bytes));
+      json.attribute("jit_memory", int64_t(jit_memory));
+    });
+  });
+  out << "\n";
+}
@@ -0,0 +1,90 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Stats - where kc spends its time and what it produces: wall-clock and CPU
+// time per phase and per optimization pass, and counts of modules,
+// functions, instructions and machine code. Timers nest and time exclusively,
+// so the lexing done while parsing counts as lexing only, and a pass manager
+// doesn't count the passes it runs. Safe to update from the JIT's compile
+// threads.
+class Stats {
+public:
+  enum Phase {
+    lex,
+    parse,
+    resolve,
+    fold,
+    codegen,  // AST to IR
+    optimize, // the pass pipeline, broken down by pass below
+    emit,     // IR to machine code
+    execute,  // top-level expressions, in the JIT or the interpreter
+    num_phases
+  };
+
+  // times phase from construction to destruction; with null stats it does
+  // nothing
+  class Timer {
+    Stats *stats;
+    Phase phase;
+    Timer *parent; // running on this thread when this one started
+    uint64_t wall, cpu; // accumulated while this timer was innermost
+    uint64_t wall_start, cpu_start;
+
+    // see share()
+    Phase shared_phase;
+    uint64_t shared_wall, shared_count;
+
+  public:
+    Timer(Stats *stats, Phase phase);
+    ~Timer();
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+    // counts wall nanoseconds of this timer's own time, and as much of its
+    // CPU time, as count runs of other: for work too fine-grained to have a
+    // Timer of its own, measured by the caller
+    void share(Phase other, uint64_t wall, uint64_t count);
+  };
+
+  // modules optimized, and the functions and IR instructions they held
+  // afterwards, so what went into the backend
+  std::atomic<uint64_t> modules{0}, functions{0}, instructions{0};
+
+  // object files produced, and the executable code in the ones the JIT
+  // loaded (objects from the cache included)
+  std::atomic<uint64_t> object_bytes{0}, code_bytes{0};
+
+  // memory the JIT holds for code and data sections, less that of the
+  // modules freed since
+  std::atomic<uint64_t> jit_memory{0};
+
+  // brackets one run of an optimization pass on the calling thread
+  void begin_pass();
+  void end_pass(llvm::StringRef name);
+
+  void print(llvm::raw_ostream &out) const;
+  void print_json(llvm::raw_ostream &out) const;
+
+private:
+  struct Time {
+    uint64_t wall = 0, cpu = 0, count = 0; // nanoseconds
+  };
+
+  mutable std::mutex mutex;
+  Time phases[num_phases];
+  llvm::StringMap<Time> passes;
+
+  // callers hold the mutex
+  static void add(Time &time, uint64_t wall, uint64_t cpu,
+                  uint64_t count = 1);
+};
+
+#endif // STATS_HPP
@@ -0,0 +1,35 @@
+#include "Symbol.hpp"
+
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+
+namespace ast {
+namespace {
+// the global interning table, the keys of the StringMap own the spellings
+struct SymbolTable {
+  llvm::StringMap<unsigned> ids;
+  std::vector<llvm::StringRef> names;
+
+  SymbolTable() { names.push_back(llvm::StringRef()); } // id 0 is ""
+};
+
+SymbolTable &symbol_table() {
+  static SymbolTable table;
+  return table;
+}
+} // namespace
+
+Symbol Symbol::intern(llvm::StringRef str) {
+  if (str.empty())
+    return Symbol();
+
+  auto &table = symbol_table();
+  auto res = table.ids.insert(std::make_pair(str, (unsigned)table.names.size()));
+  if (res.second)
+    table.names.push_back(res.first->getKey());
+  return Symbol(res.first->getValue());
+}
+
+llvm::StringRef Symbol::str() const { return symbol_table().names[id]; }
+} // namespace ast
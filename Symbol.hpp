@@ -0,0 +1,33 @@
+#ifndef SYMBOL_HPP
+#define SYMBOL_HPP
+
+#include "llvm/ADT/StringRef.h"
+
+namespace ast {
+// Symbol - an interned identifier. Every spelling is stored once in a global
+// table and symbols with the same spelling share the same id, so comparing
+// two symbols is an integer comparison.
+class Symbol {
+  unsigned id;
+
+  explicit Symbol(unsigned id) : id(id) {}
+
+public:
+  // the empty symbol
+  Symbol() : id(0) {}
+
+  // returns the symbol for str, adding it to the table if it's new
+  static Symbol intern(llvm::StringRef str);
+
+  // dense id, usable as an index into side tables
+  unsigned get_id() const { return id; }
+
+  // the spelling, valid for the lifetime of the program
+  llvm::StringRef str() const;
+
+  bool operator==(Symbol other) const { return id == other.id; }
+  bool operator!=(Symbol other) const { return id != other.id; }
+};
+} // namespace ast
+
+#endif // SYMBOL_HPP
@@ -11,6 +11,10 @@ class NumberExprAST;
 class VariableExprAST;
 class BinaryExprAST;
 class CallExprAST;
+class IfExprAST;
+class ForExprAST;
+class VarExprAST;
+class AssignExprAST;
 class PrototypeAST;
 class FunctionAST;
 } // namespace ast
@@ -20,22 +24,34 @@ class FunctionAST;
 class NodeVisitor {
 public:
   // NumberExprAST
-  virtual llvm::Value *visit(ast::NumberExprAST *node) = 0;
+  virtual llvm::Value *visit(const ast::NumberExprAST *node) = 0;
 
   // VariableExprAST
-  virtual llvm::Value *visit(ast::VariableExprAST *node) = 0;
+  virtual llvm::Value *visit(const ast::VariableExprAST *node) = 0;
 
   // BinaryExprAST
-  virtual llvm::Value *visit(ast::BinaryExprAST *node) = 0;
+  virtual llvm::Value *visit(const ast::BinaryExprAST *node) = 0;
 
   // CallExprAST
-  virtual llvm::Value *visit(ast::CallExprAST *node) = 0;
+  virtual llvm::Value *visit(const ast::CallExprAST *node) = 0;
+
+  // IfExprAST
+  virtual llvm::Value *visit(const ast::IfExprAST *node) = 0;
+
+  // ForExprAST
+  virtual llvm::Value *visit(const ast::ForExprAST *node) = 0;
+
+  // VarExprAST
+  virtual llvm::Value *visit(const ast::VarExprAST *node) = 0;
+
+  // AssignExprAST
+  virtual llvm::Value *visit(const ast::AssignExprAST *node) = 0;
 
   // PrototypeAST
-  virtual llvm::Function *visit(ast::PrototypeAST *node) = 0;
+  virtual llvm::Function *visit(const ast::PrototypeAST *node) = 0;
 
   // FunctionAST
-  virtual llvm::Function *visit(ast::FunctionAST *node) = 0;
+  virtual llvm::Function *visit(const ast::FunctionAST *node) = 0;
 };
 
 #endif // VISITOR_HPP
@@ -0,0 +1,369 @@
+// kc-bench - benchmarks for every stage of kc: lexing, parsing, IR
+// generation, adding modules to the JIT, whole or one definition at a time as
+// the REPL does, calling JIT'd code, and redefining
+// a function while another thread calls it. Each result is printed as one
+// JSON object per line, so runs can be diffed and tracked; kc-bench fails if
+// a call saw a definition it should not have.
+//
+//   kc-bench [--filter=substring] [--min-time=seconds]
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Codegen.hpp"
+#include "Compiler.hpp"
+#include "FunctionTable.hpp"
+#include "Lexer.hpp"
+#include "Resolver.hpp"
+#include "Session.hpp"
+
+namespace cl = llvm::cl;
+
+static cl::opt<std::string>
+    filter("filter",
+           cl::desc("Only run benchmarks whose benchmark/workload name "
+                    "contains this"),
+           cl::init(""));
+
+static cl::opt<double>
+    min_time("min-time",
+             cl::desc("Repeat each benchmark for at least this many seconds"),
+             cl::init(0.5));
+
+namespace {
+// Workload - generated source text
+struct Workload {
+  std::string name;
+  std::string source;
+  std::string entry; // function that runs the whole workload
+  unsigned arity;
+};
+
+// n definitions, each a nest of depth alternating + and * around x
+Workload deep_expressions(unsigned n, unsigned depth) {
+  std::string src;
+  for (unsigned i = 0; i < n; i++) {
+    std::string body = "x";
+    for (unsigned d = 0; d < depth; d++)
+      body = "(" + body + (d % 2 ? " * " : " + ") + std::to_string(d % 7 + 1) +
+             ")";
+    src += "def deep" + std::to_string(i) + "(x) " + body + ";\n";
+  }
+  return {"deep_expressions", src, "deep0", 1};
+}
+
+// n small independent definitions
+Workload many_definitions(unsigned n) {
+  std::string src;
+  for (unsigned i = 0; i < n; i++)
+    src += "def f" + std::to_string(i) + "(x y) x * y + " + std::to_string(i) +
+           " < x - y;\n";
+  return {"many_definitions", src, "f0", 2};
+}
+
+// c0 .. c(n-1), each calling the one before
+Workload call_chain(unsigned n) {
+  std::string src = "def c0(x) x + 1;\n";
+  for (unsigned i = 1; i < n; i++)
+    src += "def c" + std::to_string(i) + "(x) c" + std::to_string(i - 1) +
+           "(x) * 1 + 1;\n";
+  return {"call_chain", src, "c" + std::to_string(n - 1), 1};
+}
+
+std::unique_ptr<llvm::MemoryBuffer> buffer(const std::string &src) {
+  return llvm::MemoryBuffer::getMemBuffer(src, "<bench>", false);
+}
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// runs one iteration at a time until min_time has passed; an iteration
+// returns the seconds it wants counted and adds the work it did to items
+struct Result {
+  unsigned iterations = 0;
+  double seconds = 0;
+  double items = 0;
+};
+
+Result repeat(const std::function<double(double &items)> &iteration) {
+  Result r;
+  auto start = Clock::now();
+  do {
+    r.seconds += iteration(r.items);
+    r.iterations++;
+  } while (seconds_since(start) < min_time);
+  return r;
+}
+
+// extra is more fields, each starting with ", "
+void report(const std::string &bench, const std::string &workload,
+            const std::string &unit, const Result &r,
+            const std::string &extra = "") {
+  llvm::outs() << "{\"benchmark\": \"" << bench << "\", \"workload\": \""
+               << workload << "\", \"iterations\": " << r.iterations
+               << ", \"seconds\": " << llvm::format("%.6f", r.seconds)
+               << ", \"items\": " << llvm::format("%.0f", r.items)
+               << ", \"rate\": " << llvm::format("%.1f", r.items / r.seconds)
+               << ", \"unit\": \"" << unit << "/s\"" << extra << "}\n";
+  llvm::outs().flush();
+}
+
+// name is benchmark/workload, as reported
+bool selected(const std::string &name) {
+  return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+// Lexer::get_tok over the whole buffer
+void bench_lexer(const Workload &w) {
+  auto r = repeat([&](double &items) {
+    ast::Lexer lexer(buffer(w.source));
+    auto start = Clock::now();
+    while (lexer.get_tok() != ast::tok_eof)
+      items++;
+    return seconds_since(start);
+  });
+  report("lexer", w.name, "tokens", r);
+}
+
+// the Compiler's recursive descent parser, lexing included
+void bench_parser(const Workload &w) {
+  ast::Compiler compiler{ast::Options()};
+  auto r = repeat([&](double &items) {
+    auto start = Clock::now();
+    items += compiler.parse_source(buffer(w.source), [](ast::FunctionAST *) {});
+    return seconds_since(start);
+  });
+  report("parser", w.name, "items", r);
+}
+
+// resolves every definition and generates its IR into one module, counting
+// only the Codegen visit
+void bench_codegen(const Workload &w) {
+  ast::Options options;
+  ast::Compiler parser(options);
+  ast::FunctionTable functions;
+  ast::Resolver resolver(functions);
+  Codegen codegen(functions, options);
+
+  auto r = repeat([&](double &items) {
+    double seconds = 0;
+    parser.parse_source(buffer(w.source), [&](ast::FunctionAST *fn) {
+      if (!resolver.resolve(fn))
+        return;
+      auto start = Clock::now();
+      fn->accept(&codegen);
+      seconds += seconds_since(start);
+      items++;
+    });
+    codegen.init_module(); // drop the module
+    return seconds;
+  });
+  report("codegen", w.name, "functions", r);
+}
+
+// KaleidoscopeJIT::addModule for the whole workload as one module, and then
+// the lookup that compiles it to machine code
+void bench_jit(const Workload &w) {
+  ast::Options options;
+  ast::Compiler parser(options);
+  Result added, ready;
+  auto start = Clock::now();
+  do {
+    // a fresh JIT every time, so the cost doesn't grow with the iterations
+    ast::FunctionTable functions;
+    ast::Resolver resolver(functions);
+    Codegen codegen(functions, options);
+    unsigned entry = 0;
+    parser.parse_source(buffer(w.source), [&](ast::FunctionAST *fn) {
+      if (resolver.resolve(fn) && fn->accept(&codegen))
+        entry = fn->get_proto()->get_id();
+    });
+
+    auto add_start = Clock::now();
+    codegen.add_module();
+    added.seconds += seconds_since(add_start);
+    added.items++;
+    added.iterations++;
+
+    auto lookup_start = Clock::now();
+    codegen.get_address(entry);
+    ready.seconds += seconds_since(lookup_start);
+    ready.items++;
+    ready.iterations++;
+  } while (seconds_since(start) < min_time);
+  // both are measured in the same run, but only the selected ones reported
+  if (selected("jit_add_module/" + w.name))
+    report("jit_add_module", w.name, "modules", added);
+  if (selected("jit_materialize/" + w.name))
+    report("jit_materialize", w.name, "modules", ready);
+}
+
+// KaleidoscopeJIT::addModule once per definition, each in a module of its
+// own as the REPL adds them. Reports the seconds to add the whole workload
+// and the milliseconds per add, overall and over the last tenth of the adds:
+// those grow with the workload if an add costs more the more modules there
+// are before it
+void bench_jit_each(const Workload &w) {
+  ast::Options options;
+  ast::Compiler parser(options);
+  Result r;
+  double last_seconds = 0, last_items = 0;
+  auto start = Clock::now();
+  do {
+    // a fresh JIT every time, so the cost doesn't grow with the iterations
+    ast::FunctionTable functions;
+    ast::Resolver resolver(functions);
+    Codegen codegen(functions, options);
+    std::vector<double> adds;
+    parser.parse_source(buffer(w.source), [&](ast::FunctionAST *fn) {
+      if (!resolver.resolve(fn) || !fn->accept(&codegen))
+        return;
+      auto add_start = Clock::now();
+      codegen.add_module();
+      adds.push_back(seconds_since(add_start));
+      codegen.init_module();
+    });
+
+    for (unsigned i = 0; i < adds.size(); i++) {
+      r.seconds += adds[i];
+      if (i >= adds.size() - adds.size() / 10) {
+        last_seconds += adds[i];
+        last_items++;
+      }
+    }
+    r.items += adds.size();
+    r.iterations++;
+  } while (seconds_since(start) < min_time);
+
+  std::string extra;
+  llvm::raw_string_ostream os(extra);
+  os << ", \"seconds_per_run\": "
+     << llvm::format("%.6f", r.seconds / r.iterations)
+     << ", \"ms_per_add\": " << llvm::format("%.4f", 1e3 * r.seconds / r.items)
+     << ", \"last_tenth_ms_per_add\": "
+     << llvm::format("%.4f", 1e3 * last_seconds / last_items);
+  report("jit_add_each", w.name, "modules", r, os.str());
+}
+
+// steady-state calls into JIT'd code through a Function handle
+void bench_calls(const Workload &w) {
+  ast::Session session;
+  if (!session.add(w.source))
+    return;
+
+  const unsigned batch = 1 << 16;
+  volatile double sink = 0;
+  Result r;
+  if (w.arity == 1) {
+    auto f = session.get<double(double)>(w.entry);
+    f(0); // compile it first
+    r = repeat([&](double &items) {
+      auto start = Clock::now();
+      double sum = 0;
+      for (unsigned i = 0; i < batch; i++)
+        sum += f(i);
+      sink = sum;
+      items += batch;
+      return seconds_since(start);
+    });
+  } else {
+    auto f = session.get<double(double, double)>(w.entry);
+    f(0, 0);
+    r = repeat([&](double &items) {
+      auto start = Clock::now();
+      double sum = 0;
+      for (unsigned i = 0; i < batch; i++)
+        sum += f(i, 1);
+      sink = sum;
+      items += batch;
+      return seconds_since(start);
+    });
+  }
+  (void)sink;
+  report("calls", w.name, "calls", r);
+}
+
+// concurrent mode: adds a new definition of step over and over while
+// another thread keeps calling f, which calls step. f is generated before
+// step is defined, so it reaches step through its slot from the start. Each
+// call has to run a published definition, never an older one than the call
+// before it did; false if one didn't
+bool bench_redefinition() {
+  ast::Options options;
+  options.concurrent = true;
+  ast::Session session(options);
+  if (!session.add("extern step(x); def f(x) step(x) * 1;") ||
+      !session.add("def step(x) x + 1;"))
+    return false;
+  auto f = session.get_shared<double(double)>("f");
+
+  // the newest definition that may have been published, set before add()
+  std::atomic<double> newest{1};
+  std::atomic<bool> done{false}, failed{false};
+  std::thread caller([&] {
+    double last = 0;
+    while (!done.load(std::memory_order_relaxed)) {
+      double result = f(0);
+      if (result < last || result > newest.load())
+        failed = true;
+      last = result;
+    }
+  });
+
+  double k = 1;
+  auto r = repeat([&](double &items) {
+    newest = ++k;
+    auto start = Clock::now();
+    if (!session.add("def step(x) x + " + std::to_string((unsigned)k) + ";"))
+      failed = true;
+    items++;
+    return seconds_since(start);
+  });
+  done = true;
+  caller.join();
+  report("redefinition", "concurrent_calls", "definitions", r);
+
+  if (failed)
+    llvm::errs() << "redefinition: a call ran a definition it should not "
+                    "have\n";
+  return !failed;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "kc benchmarks\n");
+
+  std::vector<Workload> workloads = {deep_expressions(50, 200),
+                                     many_definitions(1000), call_chain(300)};
+
+  for (auto &w : workloads) {
+    if (selected("lexer/" + w.name))
+      bench_lexer(w);
+    if (selected("parser/" + w.name))
+      bench_parser(w);
+    if (selected("codegen/" + w.name))
+      bench_codegen(w);
+    if (selected("jit_add_module/" + w.name) ||
+        selected("jit_materialize/" + w.name))
+      bench_jit(w);
+    if (selected("jit_add_each/" + w.name))
+      bench_jit_each(w);
+    if (selected("calls/" + w.name))
+      bench_calls(w);
+  }
+  if (selected("redefinition/concurrent_calls") && !bench_redefinition())
+    return 1;
+  return 0;
+}